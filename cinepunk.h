@@ -16,6 +16,20 @@ enum CPColorType {
     CP_YUVBLOCK
 };
 
+// Speed/quality tradeoff of the encoder, fastest first
+enum CPPreset {
+    CP_PRESET_ULTRAFAST,
+    CP_PRESET_SUPERFAST,
+    CP_PRESET_VERYFAST,
+    CP_PRESET_FASTER,
+    CP_PRESET_FAST,
+    CP_PRESET_MEDIUM,
+    CP_PRESET_SLOW,
+    CP_PRESET_SLOWER,
+    CP_PRESET_VERYSLOW,
+    CP_PRESET_PLACEBO
+};
+
 
 // The layout of this struct is optimized for SIMD, do not touch.
 typedef struct {
@@ -27,8 +41,20 @@ typedef struct {
 struct CPEncoderState;
 struct CPDecoderState;
 
+typedef struct {
+    unsigned x,y,width,height; // In pixels
+} CPRect;
+
+typedef struct {
+    uint64_t frames; // Frames encoded so far
+    uint64_t deadline_cut; // Frames where training was cut short to meet the deadline
+    uint64_t deadline_missed; // Frames that took longer than the deadline anyway
+    uint64_t last_frame_us,max_frame_us,total_frame_us; // Encoding time
+} CPEncoderStats;
+
 #define CP_ENCFLAG_RGB2YUV_FAST (1U<<0) // Use fast RGB->YUV conversion instead of high-quality
-#define CP_ENCFLAG_NO_THREADS   (1U<<1) // Don't use threads for speedup
+#define CP_ENCFLAG_NO_THREADS   (1U<<1) // Don't use threads for speedup (same as CP_set_threads(enc,1))
+#define CP_ENCFLAG_SHARE_CODEBOOKS (1U<<2) // Train one codebook for neighbouring strips that look alike, sent once
 
 #define CP_DECDEBUG_CRYPTOMATTE (1U<<0)
 
@@ -50,8 +76,38 @@ extern size_t CP_get_buffer_size(CPEncoderState *enc);
 extern void CP_set_encflags(CPEncoderState *enc,uint32_t flags);
 extern void CP_clear_encflags(CPEncoderState *enc,uint32_t flags);
 extern void CP_set_quality(CPEncoderState *enc,uint32_t factor);
+extern void CP_set_preset(CPEncoderState *enc,CPPreset preset); // Default is CP_PRESET_MEDIUM
+// Frames from one keyframe to the next. Scene cuts get a keyframe once
+// min_interval frames have passed, max_interval forces one. Default is 6 to 61.
+extern void CP_set_keyframe_interval(CPEncoderState *enc,unsigned min_interval,unsigned max_interval);
+// Cut every strip into this many tiles side by side, each with its own codebooks (default 1).
+// Gives wide frames more units to encode in parallel. Set before getting the buffer size.
+// Decoders that ignore the strip's x range (such as FFmpeg's) can't play tiled streams.
+extern void CP_set_tile_columns(CPEncoderState *enc,unsigned columns);
+// Real-time mode: Encoding a frame should take at most this long (0 = no deadline).
+// Training is cut short as the deadline approaches, trading quality for time.
+// Not applied to GOP-parallel segments, which don't run in real time anyway.
+extern void CP_set_deadline(CPEncoderState *enc,unsigned microseconds);
+extern void CP_get_stats(CPEncoderState *enc,CPEncoderStats *stats);
+extern void CP_set_threads(CPEncoderState *enc,unsigned threads); // 0 = one per hardware thread
 extern bool CP_push_frame(CPEncoderState *enc,CPColorType ctype,const void *data);
 extern size_t CP_pull_frame(CPEncoderState *enc,uint8_t *buffer);
+// Like CP_push_frame, for when the caller knows which rectangles changed since the last pushed frame.
+// data is still the whole frame, but only the rectangles are read and encoded, the rest is skipped.
+// The first frame is always taken whole.
+extern bool CP_push_frame_damaged(CPEncoderState *enc,CPColorType ctype,const void *data,const CPRect *rects,unsigned rect_count);
+// Asynchronous alternative to push/pull. Don't mix the two on one encoder.
+// Settings must be made before the first frame is submitted.
+// Submitting fails when queue_depth frames are waiting to be received.
+// Submitting nullptr ends the stream, after which all frames can be received.
+// Receiving returns 0 if no packet is ready (or none can become ready without more input).
+extern void CP_set_queue_depth(CPEncoderState *enc,unsigned depth);
+extern bool CP_submit_frame(CPEncoderState *enc,CPColorType ctype,const void *data);
+extern size_t CP_receive_packet(CPEncoderState *enc,uint8_t *buffer,bool wait);
+// Encode up to this many keyframe-to-keyframe segments in parallel (async API only).
+// Segments start at the keyframes a serial encode would pick, so the output is the same.
+// Needs enough memory to hold all frames of those segments.
+extern void CP_set_gop_parallel(CPEncoderState *enc,unsigned segments);
 
 // From decoder.cpp
 extern bool CP_peek_dimensions(uint8_t *data, size_t data_size, unsigned *widthOut, unsigned *heightOut, size_t *sizeOut);
@@ -110,8 +110,8 @@ int main(int argc, char **argv) {
     auto mode = get_string(args);
     if (mode) fprintf(stderr,"mode: %s\n",mode.value().c_str());
     if (mode == "encstill" || mode == "encraw") {
-        unsigned width = 640, height = 480, max_strips = 3, rate = 30, quality = 0;
-        bool makeAvi = false;
+        unsigned width = 640, height = 480, max_strips = 3, rate = 30, quality = 0, preset = CP_PRESET_MEDIUM, threads = 0, queue_depth = 8, gop_segments = 0, tile_columns = 1;
+        bool makeAvi = false, shareCodebooks = false;
         std::optional<std::string> infile,outfile;
         while (!args.empty()) {
             auto arg = get_string(args);
@@ -119,10 +119,30 @@ int main(int argc, char **argv) {
                 auto argval = get_string(args);
                 if (!argval) argFail(argv[0]);
                 quality = std::stoi(argval.value());
+            } else if (arg == "-preset") {
+                auto argval = get_string(args);
+                if (!argval) argFail(argv[0]);
+                preset = std::stoi(argval.value());
             } else if (arg == "-strips") {
                 auto argval = get_string(args);
                 if (!argval) argFail(argv[0]);
                 max_strips = std::stoi(argval.value());
+            } else if (arg == "-tiles") {
+                auto argval = get_string(args);
+                if (!argval) argFail(argv[0]);
+                tile_columns = std::stoi(argval.value());
+            } else if (arg == "-threads") {
+                auto argval = get_string(args);
+                if (!argval) argFail(argv[0]);
+                threads = std::stoi(argval.value());
+            } else if (arg == "-queue" && mode == "encraw") {
+                auto argval = get_string(args);
+                if (!argval) argFail(argv[0]);
+                queue_depth = std::stoi(argval.value());
+            } else if (arg == "-gops" && mode == "encraw") {
+                auto argval = get_string(args);
+                if (!argval) argFail(argv[0]);
+                gop_segments = std::stoi(argval.value());
             } else if (arg == "-w" && mode == "encraw") {
                 auto argval = get_string(args);
                 if (!argval) argFail(argv[0]);
@@ -137,6 +157,8 @@ int main(int argc, char **argv) {
                 rate = std::stoi(argval.value());
             } else if (arg == "-avi" && mode == "encraw") {
                 makeAvi = true;
+            } else if (arg == "-share") {
+                shareCodebooks = true;
             } else if (!infile) {
                 infile = arg;
             } else if (!outfile) {
@@ -155,6 +177,10 @@ int main(int argc, char **argv) {
             }
             auto encoder = CP_create_encoder(width,height,max_strips); // TODO strip buffers
             CP_set_quality(encoder,quality);
+            CP_set_preset(encoder,CPPreset(preset));
+            CP_set_threads(encoder,threads);
+            CP_set_tile_columns(encoder,tile_columns);
+            if (shareCodebooks) CP_set_encflags(encoder,CP_ENCFLAG_SHARE_CODEBOOKS);
             std::vector<uint8_t> cinep_buffer(CP_get_buffer_size(encoder));
             CP_push_frame(encoder,CP_RGB24,rgb_buffer.data());
             CP_push_frame(encoder,CP_RGB24,nullptr);
@@ -193,32 +219,42 @@ int main(int argc, char **argv) {
             SimpleAVIWriter avi(*output);
             auto encoder = CP_create_encoder(width,height,max_strips);
             CP_set_quality(encoder,quality);
+            CP_set_preset(encoder,CPPreset(preset));
+            CP_set_threads(encoder,threads);
+            CP_set_tile_columns(encoder,tile_columns);
+            if (shareCodebooks) CP_set_encflags(encoder,CP_ENCFLAG_SHARE_CODEBOOKS);
+            CP_set_queue_depth(encoder,queue_depth);
+            CP_set_gop_parallel(encoder,gop_segments);
             std::vector<uint8_t> rgb_buffer(width*height*3);
             std::vector<uint8_t> cvid_buffer(CP_get_buffer_size(encoder));
             bool stream_end = false;
             if (makeAvi) avi.begin_simple("cvid"_4cc,width,height,1,rate);
-            for (;;) {
-                if (!stream_end) {
-                    input->read(reinterpret_cast<std::istream::char_type *>(rgb_buffer.data()),rgb_buffer.size());
-                    if (input->eof()) {
-                        stream_end = true;
-                        fprintf(stderr,"WTF EOF\n");
-                        CP_push_frame(encoder,CP_RGB24,nullptr);
-                    } else {
-                        CP_push_frame(encoder,CP_RGB24,rgb_buffer.data());
-                    }
+            auto write_packet = [&](size_t size) {
+                if (makeAvi) {
+                    avi.write_chunk("00dc"_4cc,cvid_buffer.data(),size);
+                } else {
+                    output->write(reinterpret_cast<std::istream::char_type *>(cvid_buffer.data()),size);
                 }
-                auto size = CP_pull_frame(encoder,cvid_buffer.data());
-                if (size > 0) {
-                    if (makeAvi) {
-                        avi.write_chunk("00dc"_4cc,cvid_buffer.data(),size);
-                    } else {
-                        output->write(reinterpret_cast<std::istream::char_type *>(cvid_buffer.data()),size);
-                    }
-                    frame_count++;
-                } else if (stream_end) {
-                    break;
+                frame_count++;
+            };
+            while (!stream_end) {
+                input->read(reinterpret_cast<std::istream::char_type *>(rgb_buffer.data()),rgb_buffer.size());
+                const void *frame = rgb_buffer.data();
+                if (input->eof()) {
+                    stream_end = true;
+                    fprintf(stderr,"WTF EOF\n");
+                    frame = nullptr;
                 }
+                // Encoder converts and encodes in the background while we read the next frame
+                while (!CP_submit_frame(encoder,CP_RGB24,frame)) {
+                    write_packet(CP_receive_packet(encoder,cvid_buffer.data(),true));
+                }
+                while (auto size = CP_receive_packet(encoder,cvid_buffer.data(),false)) {
+                    write_packet(size);
+                }
+            }
+            while (auto size = CP_receive_packet(encoder,cvid_buffer.data(),true)) {
+                write_packet(size);
             }
             fprintf(stderr,"Processed %u frames\n",frame_count);
             if (makeAvi) avi.set_total_frames(frame_count);
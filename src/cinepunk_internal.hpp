@@ -21,9 +21,21 @@ typedef uint64_t u64;
 #include <algorithm>
 #include <memory>
 #include <numeric>
+#include <vector>
+#include <array>
+#include <bitset>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 #include <cstring>
 #include <cassert>
 
+typedef std::chrono::steady_clock CPClock;
+
 
 struct PacketWriter {
     u8 *begin,*ptr;
@@ -126,6 +138,168 @@ struct BitstreamReader {
     BitstreamReader(PacketReader &packet) : packet{packet} {};
 };
 
+// Long-lived work-stealing pool owned by the encoder.
+// Tasks are submitted into a TaskGroup and waited on through it.
+// Each worker has its own deque: it pops its own newest task first
+// and steals the oldest task of other workers when it runs dry.
+// A thread waiting on a group helps running queued tasks,
+// so tasks can themselves submit and wait on nested groups.
+struct CPThreadPool {
+    struct TaskGroup {
+        std::atomic<uint> pending{0};
+    };
+
+    // With zero workers, run() executes the task immediately
+    void run(TaskGroup &group,std::function<void()> fun);
+    void wait(TaskGroup &group);
+    void set_workers(uint count);
+    uint worker_count() {return workers.size();}
+
+    // Split [begin,end) into chunks of at most chunk_size and run fun(chunk_begin,chunk_end) on each
+    template<typename F>
+    void parallel_for(uint begin,uint end,uint chunk_size,F fun) {
+        if (workers.empty() || end-begin <= chunk_size) {
+            if (begin < end) fun(begin,end);
+            return;
+        }
+        TaskGroup group;
+        for (uint i=begin;i<end;i+=chunk_size) {
+            uint chunk_end = std::min(end,i+chunk_size);
+            run(group,[=,&fun](){fun(i,chunk_end);});
+        }
+        wait(group);
+    }
+
+    CPThreadPool(uint count) {set_workers(count);}
+    ~CPThreadPool() {set_workers(0);}
+private:
+    struct Task {
+        TaskGroup *group;
+        std::function<void()> fun;
+    };
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+    // One queue per worker plus one for outside threads
+    std::unique_ptr<WorkQueue[]> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cv;
+    std::atomic<uint> queued{0};
+    bool quit = false;
+
+    uint own_queue();
+    bool get_task(uint self,Task &task);
+    void run_task(Task &task);
+    void worker_loop(uint self);
+};
+
+// In rgbyuv.cpp
+// Same as the CP_ versions, but for a rectangle out of a frame that is stride blocks wide
+void gray2yuv_strided(CPYuvBlock *dst, const uint8_t* src, uint blockWidth, uint blockHeight, uint stride);
+void rgb2yuv_fast_strided(CPYuvBlock *dst, const uint8_t* src, uint blockWidth, uint blockHeight, uint stride);
+void rgb2yuv_hq_strided(CPYuvBlock *dst, const uint8_t* src, uint blockWidth, uint blockHeight, uint stride);
+
+// In vq_elbg.cpp
+
+// Lanes are over-allocated by this much so SIMD kernels can load whole registers past the end
+constexpr uint training_set_padding = 16;
+// Identical blocks stop folding into a vector at this weight, so weighted distortion still fits in 32 bits
+constexpr uint coalesce_weight_limit = 8192;
+
+// Vectors to train a codebook on, with one contiguous lane per component.
+// Gathered once from the image, so the VQ kernels stream linearly.
+// Identical blocks are gathered as one vector carrying their summed weight.
+struct TrainingSet {
+    uint count = 0;
+    uint source_count = 0; // Image blocks the set stands for, duplicates included
+    std::vector<uint> indices; // Image index of each vector
+    std::vector<std::pair<uint,uint>> duplicates; // Image index and vector of each folded block
+    std::vector<uint> slots; // Hash table used by gather
+    std::vector<u8> ytl,ytr,ybl,ybr,u,v;
+    std::vector<u16> weight;
+    bool mono = false; // All vectors have neutral chroma
+
+    void resize(uint size);
+    void gather(const CPYuvBlock *data,const std::vector<uint> &applicable_indices);
+    void expand_labels(std::vector<u8> &closest) const;
+    inline CPYuvBlock block(uint n) const {
+        return {.weight = weight[n],.u = u[n],.v = v[n],.ytl = ytl[n],.ytr = ytr[n],.ybl = ybl[n],.ybr = ybr[n]};
+    }
+    inline void set_block(uint n,CPYuvBlock blk) {
+        weight[n] = blk.weight;
+        u[n] = blk.u;
+        v[n] = blk.v;
+        ytl[n] = blk.ytl;
+        ytr[n] = blk.ytr;
+        ybl[n] = blk.ybl;
+        ybr[n] = blk.ybr;
+    }
+};
+
+// Voronoi partition as a flat nearest-codeword label per training vector.
+// group() counting-sorts the training set into one contiguous bucket per codeword.
+// A SoCA shift only rewrites the buckets it touches, into spare room after the sorted ones.
+// Buffers are kept with the encoder and reused, so passes don't allocate.
+struct VoronoiPartition {
+    std::vector<u8> label; // Per training vector
+    TrainingSet grouped; // Training vectors in bucket order, then room for rewritten buckets
+    std::vector<uint> members; // Training set position of each grouped vector
+    std::array<uint,256> bucket_start,bucket_end;
+    uint grouped_end; // Start of the unused room in grouped
+    std::vector<u8> shift_label; // Scratch for SoCA, split of the to bucket
+
+    void group(const TrainingSet &set);
+    void shift(const TrainingSet &set,uint from,uint replace,uint to);
+    uint bucket_size(uint code) const {return bucket_end[code]-bucket_start[code];}
+};
+
+// In vq_fastpnn.cpp
+
+// Cheapest merge inside a kd-tree leaf, kept until the leaf changes
+struct LeafMerge {
+    u32 distortion;
+    u8 first,second;
+    u8 inter_weight;
+    bool dirty;
+};
+
+// kd-tree node for PNN. Nodes link to each other by index into PNNWorkspace::nodes.
+struct KDnode {
+    int8_t axis_or_fill; // if positive, offset of split element, if negative, amount of leaf data
+    u8 threshold;
+    union {
+        struct {
+            uint lower,upper;
+        };
+        struct {
+            uint leaf_data; // Index into PNNWorkspace::vectors
+            LeafMerge merge;
+        };
+    };
+    inline bool is_leaf() const {return axis_or_fill < 0;};
+    KDnode() : axis_or_fill{0},threshold{0},lower{0},upper{0} {};
+    // leaf constructor
+    KDnode(uint leaf_data,uint fill) : axis_or_fill{int8_t(-int(fill))},threshold{0},leaf_data{leaf_data},merge{.distortion = 0,.first = 0,.second = 0,.inter_weight = 0,.dirty = true} {};
+    // branch constructor
+    KDnode(uint lower,uint upper,u8 threshold,uint axis) : axis_or_fill{int8_t(axis)},threshold{threshold},lower{lower},upper{upper} {};
+};
+
+// Buffers for one PNN run, kept with the encoder and reused.
+// The tree lives in one node array, so dropping it is just a clear().
+struct PNNWorkspace {
+    std::vector<CPYuvBlock> vectors;
+    std::vector<KDnode> nodes;
+    std::vector<uint> free_nodes; // Nodes given back by rebalancing, used before growing the array
+    std::vector<uint> heap,dirty; // Leaves with merge candidates
+    std::vector<uint> spare; // Nodes handed out up front to a tree build
+
+    uint alloc_node();
+    void free_subtree(uint node);
+    void clear() {nodes.clear();free_nodes.clear();}
+};
+
 struct CPDecoderState {
     const uint frame_mbWidth,frame_mbHeight;
     uint32_t debug_flags = 0;
@@ -143,36 +317,126 @@ struct CPDecoderState {
     CPDecoderState(uint frame_width,uint frame_height);
 };
 
+// How hard the encoder tries, set through CP_set_preset
+struct CPEffort {
+    uint lbg_iterations; // LBG passes once the codebook has reached its size
+    uint split_iterations; // LBG passes between codebook splits
+    uint soca_iterations; // Passes to place the two codewords of a shift
+    uint soca_search_len; // Lowest-utility codewords tried for shifting, 0 disables SoCA
+    bool pnn_init; // Initialize codebooks with PNN, otherwise split up from a single codeword
+    bool retrain; // Train again on just the macroblocks that ended up using each codebook
+};
+extern const CPEffort effort_presets[CP_PRESET_PLACEBO+1];
+
 struct CPEncoderState {
 
     const uint frame_mbWidth,frame_mbHeight,max_strips;
     uint32_t encoder_flags = 0;
     uint32_t quality_factor = 0;
+    CPEffort effort = effort_presets[CP_PRESET_MEDIUM];
+    uint deadline_us = 0; // 0 means no deadline
+    CPClock::time_point frame_start; // Of the frame being encoded
+    std::atomic<bool> deadline_cut = false; // Set by any stage that stopped early
+    std::atomic<u64> pnn_ns_per_vector = 0; // Speed of the last PNN run
+    std::mutex stats_lock;
+    CPEncoderStats stats = {};
+    uint thread_count = 0; // 0 means one per hardware thread
+    std::shared_ptr<CPThreadPool> pool; // Shared with segment encoders
     std::unique_ptr<CPYuvBlock[]> cur_frame;
     std::unique_ptr<CPYuvBlock[]> cur_frame_v1;
     std::unique_ptr<CPYuvBlock[]> next_frame;
+    std::unique_ptr<CPYuvBlock[]> prev_frame; // Input before cur_frame, for scene cut detection
     std::unique_ptr<u32[]> skip_mb_distortion;
+    // How much each macroblock's input changed since the previous frame, and will in the next one
+    std::unique_ptr<u32[]> change_mb_distortion,next_change_mb_distortion;
     CPDecoderState decode_state;
-    std::vector<std::array<CPYuvBlock,256>> prev_codes_v4;
-    std::vector<std::array<CPYuvBlock,256>> prev_codes_v1;
+    // Codebook slots of each strip that every decoder holds, even one that started at the last keyframe
+    std::vector<std::bitset<256>> known_slots_v4;
+    std::vector<std::bitset<256>> known_slots_v1;
+    // Codebooks each strip trained on all of its changed macroblocks in the last frame, for warm starts.
+    // Not the final ones, as those only fit the macroblocks that ended up using them.
+    std::vector<std::vector<CPYuvBlock>> prev_codes_v4;
+    std::vector<std::vector<CPYuvBlock>> prev_codes_v1;
+    // Mean distortion per training vector the last full training reached
+    std::vector<u64> prev_distortion_v4;
+    std::vector<u64> prev_distortion_v1;
     uint64_t frame_count = 0;
-    uint inter_frames_left = 0;
+    uint frames_since_keyframe = 0;
+    std::vector<uint> strip_ytop; // Strip boundaries in macroblock rows, ends with frame_mbHeight
+    uint tile_columns = 1; // Tiles per strip row
+    uint min_keyframe_interval = 6;
+    uint max_keyframe_interval = 61;
     uint frames_pushed = 0;
-    
+    // Which macroblocks changed in the frames from CP_push_frame_damaged, empty for whole frames
+    std::vector<u8> cur_damage,next_damage;
+
+    // Asynchronous submit/receive pipeline.
+    // Submitted frames are converted on the pool while a dedicated
+    // encode thread works through them in order.
+    struct AsyncFrame {
+        std::unique_ptr<CPYuvBlock[]> yuv;
+        std::unique_ptr<u8[]> input; // Copy of submitted data
+        CPColorType ctype;
+        bool end_of_stream = false;
+        CPThreadPool::TaskGroup convert_task;
+    };
+    // GOP-parallel mode: Each segment from one keyframe to the next
+    // is encoded by its own encoder on its own thread.
+    struct AsyncSegment {
+        std::vector<std::unique_ptr<CPYuvBlock[]>> frames;
+        std::unique_ptr<CPYuvBlock[]> lookahead; // First frame of next segment, null at end of stream
+        std::vector<std::vector<u8>> packets;
+        std::thread thread;
+        bool done = false;
+    };
+    uint queue_depth = 2;
+    uint gop_segments = 0;
+    std::deque<std::unique_ptr<AsyncSegment>> async_segments;
+    std::thread async_thread;
+    std::mutex async_lock;
+    std::condition_variable async_cv;
+    std::deque<std::unique_ptr<AsyncFrame>> async_frames;
+    std::deque<std::vector<u8>> async_packets;
+    std::vector<std::unique_ptr<CPYuvBlock[]>> async_free_frames;
+    uint64_t async_submitted = 0, async_produced = 0, async_received = 0;
+    // GOP-parallel mode: Frames the segmenting thread has looked at, and handed to segments
+    uint64_t async_scanned = 0, async_segmented = 0;
+    bool async_eof = false, async_quit = false;
+    std::mutex partition_lock;
+    std::vector<std::unique_ptr<VoronoiPartition>> free_partitions;
+    std::mutex pnn_workspace_lock;
+    std::vector<std::unique_ptr<PNNWorkspace>> free_pnn_workspaces;
+
     uint total_macroblocks() {return frame_mbWidth*frame_mbHeight;}
     uint total_blocks() {return total_macroblocks()*4;}
     uint mb_index(uint x,uint y) {return x+y*frame_mbWidth*1;}
     uint blk_index(uint x,uint y) {return x+y*frame_mbWidth*2;}
-    bool use_threads() {return !(encoder_flags & CP_ENCFLAG_NO_THREADS);}
+    uint max_tiles() {return max_strips*tile_columns;}
+    void update_workers();
+    size_t input_size(CPColorType ctype);
+    void convert_frame(CPYuvBlock *dst,CPColorType ctype,const void *data);
+    void convert_rect(CPYuvBlock *dst,CPColorType ctype,const void *data,uint mb_x,uint mb_y,uint mb_width,uint mb_height);
+    bool untouched(uint mb) {return !cur_damage.empty() && !cur_damage[mb];}
+    void rotate_frames();
+    u32 mbDistortion(const CPYuvBlock *a,const CPYuvBlock *b,uint x,uint y);
+    bool sceneCut(const CPYuvBlock *prev,const CPYuvBlock *cur,const CPYuvBlock *next);
+    uint64_t async_limit();
+    uint64_t async_encodable();
+    void async_loop();
+    void async_loop_segments();
+    void launch_segment(std::unique_ptr<AsyncSegment> segment);
+    void finish_segment();
+    void encode_segment(AsyncSegment &segment);
 
     CPEncoderState(uint frame_width,uint frame_height, uint max_strips);
+    ~CPEncoderState();
 
     struct StripEncoding {
         enum MBEncType : u8 {
             MB_UNDECIDED,MB_V1,MB_V4,MB_SKIP,MB_SKIP_ELSE_V1
         };
         MBEncType strip_type;
-        uint ytop,height;
+        uint xleft,width,ytop,height; // In macroblocks
         uint unused_left,unused_right,unused_top,unused_bottom;
         std::vector<MBEncType> mb_types;
         std::vector<u8> mb_v1; // Best V1 vector per macroblock
@@ -187,27 +451,91 @@ struct CPEncoderState {
         }
         StripEncoding() {};
     };
+    // Codebooks trained once for a run of similar strips
+    struct SharedCodebooks {
+        std::vector<CPYuvBlock> code_v1,code_v4;
+    };
 
     // In encoder.cpp
     void doFrame(PacketWriter &packet);
-    StripEncoding tryStrip(uint ytop,uint height,bool keyframe);
-    void writeStrip(PacketWriter &packet,StripEncoding &strip);
-    void writeCodebook(PacketWriter &packet,std::vector<CPYuvBlock> book,bool isV4);
+    StripEncoding tryStrip(uint strip_index,bool keyframe,const SharedCodebooks *shared = nullptr);
+    void layoutStrips(bool keyframe);
+    uint strip_count() {return (strip_ytop.size()-1)*tile_columns;}
+    void stripArea(uint strip_index,uint &xleft,uint &width,uint &ytop,uint &height);
+    void stripDeadlines(uint strip_index,uint count,CPClock::time_point &train_deadline,CPClock::time_point &retrain_deadline);
+    std::vector<uint> shareRuns();
+    void trainShared(SharedCodebooks &shared,uint first,uint count,bool keyframe);
+    bool isStill(uint mb);
+    u64 assignCodebook(const std::vector<CPYuvBlock> &codebook,const TrainingSet &set,std::vector<u8> &closest_out);
+    bool warmStart(std::vector<CPYuvBlock> &codebook,const std::vector<CPYuvBlock> &prev_codes,u64 prev_distortion,const TrainingSet &set);
+    void initCodebook(std::vector<CPYuvBlock> &codebook,const std::vector<CPYuvBlock> &prev_codes,u64 prev_distortion,
+        const TrainingSet &set,std::vector<u8> *closest_out,bool keyframe,CPClock::time_point deadline);
+    // Codebooks and their known slots are updated to what the decoder has after the strip
+    void writeStrip(PacketWriter &packet,StripEncoding &strip,std::array<CPYuvBlock,256> &book_v1,std::array<CPYuvBlock,256> &book_v4,
+        std::bitset<256> &known_v1,std::bitset<256> &known_v4,bool partial);
+    // Remaps indices if codewords move to other slots
+    void writeCodebook(PacketWriter &packet,const std::vector<CPYuvBlock> &book,bool isV4,std::array<CPYuvBlock,256> &decoder_book,
+        std::bitset<256> &known,bool partial,u8 *indices,uint index_count);
 
 
     // In vq_dummy.cpp
-    u64 vq_dummy(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const CPYuvBlock *data,std::vector<uint> &applicable_indices,std::vector<u8> *closest_out);
+    u64 vq_dummy(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const TrainingSet &set,std::vector<u8> *closest_out);
 
     // In vq_elbg.cpp
-    u64 vq_elbg(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const CPYuvBlock *data,std::vector<uint> &applicable_indices,std::vector<u8> *closest_out);
+    // Stops iterating early once the deadline has passed
+    u64 vq_elbg(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const TrainingSet &set,std::vector<u8> *closest_out,
+        CPClock::time_point deadline = CPClock::time_point::max());
+    std::unique_ptr<VoronoiPartition> acquire_partition();
+    void release_partition(std::unique_ptr<VoronoiPartition> partition);
+    std::unique_ptr<PNNWorkspace> acquire_pnn_workspace();
+    void release_pnn_workspace(std::unique_ptr<PNNWorkspace> ws);
 
     // In vq_fastpnn.cpp
-    u64 vq_fastpnn(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const CPYuvBlock *data,std::vector<uint> &applicable_indices,std::vector<u8> *closest_out);
+    u64 vq_fastpnn(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const TrainingSet &set,std::vector<u8> *closest_out);
 };
 
 // In vq_elbg.cpp
-extern u64 voronoi_partition(const std::vector<CPYuvBlock> &codebook,const CPYuvBlock *data,std::vector<uint> &applicable_indices,
-u64 *code_distortion, std::vector<std::vector<uint>> &partition
+
+// Nearest-codeword accelerator, built once per codebook update.
+// Codewords are sorted by their projection onto the codebook's principal axis.
+// The projection gap bounds the distortion from below, so the search
+// walks outwards from the vector's own projection and stops early.
+// Returns exactly the same codeword as exhaustive search (lowest index wins ties).
+struct CodebookIndex {
+    std::array<int,6> axis; // u,v,ytl,ytr,ybl,ybr
+    u64 axis_norm; // Scaled so that weight_scale*gap^2 <= axis_norm*distortion
+    std::vector<int> projection;
+    std::vector<u8> order;
+    std::vector<CPYuvBlock> codes; // Codewords in projection order
+    // Same, as pairs of 16 bit components for SIMD
+    std::vector<u32> lane_ytop,lane_ybottom,lane_uv;
+    bool mono; // All codewords have neutral chroma, so searches only compare luma
+
+    inline int project(CPYuvBlock blk) const {
+        return axis[0]*blk.u + axis[1]*blk.v + axis[2]*blk.ytl + axis[3]*blk.ytr + axis[4]*blk.ybl + axis[5]*blk.ybr;
+    }
+    void build(const std::vector<CPYuvBlock> &codebook);
+    // Codewords exclude_a/exclude_b are not considered
+    u8 nearest(CPYuvBlock vec,u32 &distortion,uint exclude_a = 256,uint exclude_b = 256) const;
+    // Also returns distortion to the second nearest codeword
+    u8 nearest2(CPYuvBlock vec,u32 &distortion,u32 &second_distortion) const;
+    // Distortion must already hold the distortion to seed_code
+    u8 nearest_seeded(CPYuvBlock vec,uint seed_code,u32 &distortion) const;
+    #ifdef CINEPUNK_AVX2
+    u8 nearest_AVX2(CPYuvBlock vec,u32 &distortion) const;
+    u8 nearest2_AVX2(CPYuvBlock vec,u32 &distortion,u32 &second_distortion) const;
+    u8 nearest_seeded_AVX2(CPYuvBlock vec,uint seed_code,u32 &distortion) const;
+    #endif
+private:
+    template<bool SECOND,bool MONO> u8 search(CPYuvBlock vec,u32 &distortion,u32 *second_distortion,uint exclude_a,uint exclude_b,uint seed_code) const;
+    #ifdef CINEPUNK_AVX2
+    template<bool SECOND,bool MONO> u8 search_AVX2(CPYuvBlock vec,u32 &distortion,u32 *second_distortion,uint seed_code) const;
+    #endif
+};
+
+// Writes the nearest codeword of training vectors [offset,offset+count) to label[0,count)
+extern u64 voronoi_partition(const std::vector<CPYuvBlock> &codebook,const TrainingSet &set,uint offset,uint count,
+u64 *code_distortion, u8 *label, CPThreadPool *pool = nullptr, const CodebookIndex *index = nullptr
 );
 
 constexpr u8 CHUNK_FRAME_INTRA = 0x00;
@@ -251,6 +579,23 @@ inline u32 blockDistortion(CPYuvBlock a,CPYuvBlock b) {
          + square(a.v - b.v) * V_WEIGHT;
 }
 
+// Distortion of luma only, the whole distortion between blocks of neutral chroma
+inline u32 lumaDistortion(CPYuvBlock a,CPYuvBlock b) {
+    u32 y_dist = square(a.ytl-b.ytl) + square(a.ytr-b.ytr) + square(a.ybl-b.ybl) + square(a.ybr-b.ybr);
+    return y_dist * Y_WEIGHT;
+}
+
+// Chroma distortion against neutral (gray) chroma.
+// Against a codebook that is all gray, this part is the same for every codeword.
+inline u32 grayChromaDistortion(CPYuvBlock a) {
+    return square(a.u - 128) * U_WEIGHT
+         + square(a.v - 128) * V_WEIGHT;
+}
+
+inline bool isGray(CPYuvBlock a) {
+    return a.u == 128 && a.v == 128;
+}
+
 inline u32 macroblockV1Distortion_sub(CPYuvBlock a, u8 y, u8 u, u8 v) {
     u32 y_dist = square(a.ytl - y) + square(a.ytr - y) + square(a.ybl - y) + square(a.ybr - y);
     return y_dist * Y_WEIGHT
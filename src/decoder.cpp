@@ -87,11 +87,17 @@ void CPDecoderState::do_decode(const uint8_t *data,size_t data_size) {
         assert(xend <= frame_mbWidth*4);
         assert(xstart%4 == 0);
         assert(xend%4 == 0);
-        if (ytop == 0) {
+        // Strips given by height follow the previous one. Tiles off the left edge have a real position.
+        if (ytop == 0 && xstart == 0) {
             ytop = prev_ybottom;
             ybottom += ytop;
         }
         prev_ybottom = ybottom;
+        // Unless the frame says otherwise, strips start from the codebooks the previous strip left
+        if (stripno > 0 && frame_type == CHUNK_FRAME_INTRA) {
+            codes_v1[stripno] = codes_v1[stripno-1];
+            codes_v4[stripno] = codes_v4[stripno-1];
+        }
         assert(ytop < ybottom);
         assert(ytop < frame_mbHeight*4);
         assert(ybottom <= frame_mbHeight*4);
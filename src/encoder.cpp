@@ -1,7 +1,38 @@
 #include "cinepunk_internal.hpp"
 #include <cstdio>
-#include <thread>
-#include <optional>
+
+// A frame is a scene cut if this share of its macroblocks (in percent) changed
+// by at least the given distortion, and far less of that change carries on into the next frame.
+constexpr uint scene_cut_changed_share = 60;
+constexpr uint scene_cut_mb_distortion = 4*TOTAL_WEIGHT*24*24;
+constexpr uint scene_cut_persistence = 2;
+// Strip layout: Macroblocks cost a base amount of VQ work plus their detail (distortion of
+// the V1 downscale), up to a cap. Each strip should carry at least strip_min_detail,
+// and the last frame's layout is kept unless its busiest strip is this much (in percent) worse.
+constexpr uint strip_base_cost = 4*TOTAL_WEIGHT*8*8;
+constexpr uint strip_detail_cap = 4*TOTAL_WEIGHT*48*48;
+constexpr u64 strip_min_detail = 256*strip_base_cost;
+constexpr uint strip_relayout_slack = 10;
+// Shared codebooks: A strip joins the run above it if the mean difference between them is at most
+// this much (in percent) of their spread, and the larger spread is at most this much of the smaller.
+// Slack is in blockDistortion units, so flat strips can still join each other.
+constexpr uint share_mean_tolerance = 25;
+constexpr uint share_spread_tolerance = 200;
+constexpr uint share_slack = 4*TOTAL_WEIGHT;
+// Inter macroblocks are left out of training if their input changed by at most this much
+// since the last frame (mean squared error of 2 per sample), and the decoder has them
+// at least this close already (mean squared error of 16), so they'll be skipped anyway.
+constexpr uint still_change_distortion = 4*TOTAL_WEIGHT*2;
+constexpr uint still_skip_distortion = 4*TOTAL_WEIGHT*16;
+// Previous codebook is reused if it fits the new frame at most this much worse (in percent)
+constexpr uint warm_start_tolerance = 150;
+// Plus this much mean distortion, so near-perfect fits don't trip the guard on noise
+constexpr uint warm_start_slack = 4*TOTAL_WEIGHT;
+// In real-time mode, share of the frame's time (in percent) for encoding strips.
+// The rest is for writing and decoding the frame.
+constexpr uint strip_time_share = 85;
+// Share of a strip's time for first training, the rest is for mode decision and retraining
+constexpr uint train_time_share = 60;
 
 CPEncoderState::CPEncoderState(unsigned frame_width, unsigned frame_height, unsigned max_strips)
 : frame_mbWidth{frame_width/4},frame_mbHeight{frame_height/4},max_strips{max_strips},decode_state{frame_width,frame_height} {
@@ -13,15 +44,44 @@ CPEncoderState::CPEncoderState(unsigned frame_width, unsigned frame_height, unsi
     frame_count = 0;
     next_frame = std::make_unique<CPYuvBlock[]>(total_blocks());
     cur_frame  = std::make_unique<CPYuvBlock[]>(total_blocks());
+    prev_frame = std::make_unique<CPYuvBlock[]>(total_blocks());
     cur_frame_v1 = std::make_unique<CPYuvBlock[]>(total_macroblocks());
     skip_mb_distortion = std::make_unique<u32[]>(total_macroblocks());
+    change_mb_distortion = std::make_unique<u32[]>(total_macroblocks());
+    next_change_mb_distortion = std::make_unique<u32[]>(total_macroblocks());
     prev_codes_v4.resize(max_strips);
     prev_codes_v1.resize(max_strips);
+    prev_distortion_v4.resize(max_strips);
+    prev_distortion_v1.resize(max_strips);
+}
+
+CPEncoderState::~CPEncoderState() {
+    if (async_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(async_lock);
+            async_quit = true;
+        }
+        async_cv.notify_all();
+        async_thread.join();
+    }
+    // Frames that were never picked up may still be converting
+    for (auto &frame : async_frames) pool->wait(frame->convert_task);
+    for (auto &segment : async_segments) segment->thread.join();
+}
+
+void CPEncoderState::update_workers() {
+    uint threads = thread_count ? thread_count : std::max(1u,std::thread::hardware_concurrency());
+    if (encoder_flags & CP_ENCFLAG_NO_THREADS) threads = 1;
+    // Calling thread also does work while waiting
+    pool->set_workers(threads-1);
 }
 
 
 CP_API CPEncoderState *CP_create_encoder(unsigned frame_width, unsigned frame_height, unsigned max_strips) {
-    return new CPEncoderState(frame_width,frame_height,max_strips);
+    auto enc = new CPEncoderState(frame_width,frame_height,max_strips);
+    enc->pool = std::make_shared<CPThreadPool>(0);
+    enc->update_workers();
+    return enc;
 }
 
 CP_API void CP_destroy_encoder(CPEncoderState *enc) {
@@ -29,43 +89,156 @@ CP_API void CP_destroy_encoder(CPEncoderState *enc) {
 }
 
 CP_API size_t CP_get_buffer_size(CPEncoderState *enc) {
-    return CP_BUFFER_SIZE(enc->frame_mbWidth*4,enc->frame_mbHeight*4,enc->max_strips);
+    return CP_BUFFER_SIZE(enc->frame_mbWidth*4,enc->frame_mbHeight*4,enc->max_tiles());
 }
 
 CP_API void CP_set_encflags(CPEncoderState *enc,uint32_t flags) {
     enc->encoder_flags |= flags;
+    enc->update_workers();
 }
 
 CP_API void CP_clear_encflags(CPEncoderState *enc,uint32_t flags) {
     enc->encoder_flags &= ~flags;
+    enc->update_workers();
+}
+
+CP_API void CP_set_threads(CPEncoderState *enc,unsigned threads) {
+    enc->thread_count = threads;
+    enc->update_workers();
 }
 
 CP_API void CP_set_quality(CPEncoderState *enc,uint32_t factor) {
     enc->quality_factor = factor;
 }
 
+const CPEffort effort_presets[CP_PRESET_PLACEBO+1] = {
+    // LBG  Split  SoCA iter  SoCA len  PNN    Retrain
+    {  1,   1,     0,           0,      false, false}, // Ultrafast
+    {  1,   1,     0,           0,      false, true }, // Superfast
+    {  1,   2,     1,          32,      true,  true }, // Veryfast
+    {  1,   2,     2,          64,      true,  true }, // Faster
+    {  2,   2,     2,         128,      true,  true }, // Fast
+    {  2,   3,     3,         256,      true,  true }, // Medium
+    {  3,   3,     3,         256,      true,  true }, // Slow
+    {  4,   4,     4,         256,      true,  true }, // Slower
+    {  6,   5,     5,         256,      true,  true }, // Veryslow
+    { 10,   8,     8,         256,      true,  true }, // Placebo
+};
+
+CP_API void CP_set_preset(CPEncoderState *enc,CPPreset preset) {
+    enc->effort = effort_presets[std::min<uint>(preset,CP_PRESET_PLACEBO)];
+}
+
+CP_API void CP_set_keyframe_interval(CPEncoderState *enc,unsigned min_interval,unsigned max_interval) {
+    enc->max_keyframe_interval = std::max(1u,max_interval);
+    enc->min_keyframe_interval = std::clamp(min_interval,1u,enc->max_keyframe_interval);
+}
+
+CP_API void CP_set_tile_columns(CPEncoderState *enc,unsigned columns) {
+    enc->tile_columns = std::clamp(columns,1u,enc->frame_mbWidth);
+    enc->prev_codes_v4.resize(enc->max_tiles());
+    enc->prev_codes_v1.resize(enc->max_tiles());
+    enc->prev_distortion_v4.resize(enc->max_tiles());
+    enc->prev_distortion_v1.resize(enc->max_tiles());
+}
+
+CP_API void CP_set_deadline(CPEncoderState *enc,unsigned microseconds) {
+    enc->deadline_us = microseconds;
+}
+
+CP_API void CP_get_stats(CPEncoderState *enc,CPEncoderStats *stats) {
+    std::lock_guard<std::mutex> lock(enc->stats_lock);
+    *stats = enc->stats;
+}
+
+constexpr uint convert_chunk_rows = 16;
+
+size_t CPEncoderState::input_size(CPColorType ctype) {
+    switch(ctype) {
+    case CP_RGB24:
+        return total_blocks()*4*3;
+    case CP_GRAY:
+        return total_blocks()*4;
+    case CP_YUVBLOCK:
+        return total_blocks()*sizeof(CPYuvBlock);
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+void CPEncoderState::convert_frame(CPYuvBlock *dst,CPColorType ctype,const void *data) {
+    uint block_width = frame_mbWidth*2;
+    auto src = (const uint8_t *)data;
+    switch(ctype) {
+    case CP_RGB24:
+        // Block rows are independent, so convert in chunks
+        pool->parallel_for(0,frame_mbHeight*2,convert_chunk_rows,[&](uint begin,uint end){
+            auto row_dst = dst+begin*block_width;
+            auto row_src = src+begin*block_width*2*2*3;
+            if (encoder_flags & CP_ENCFLAG_RGB2YUV_FAST) {
+                CP_rgb2yuv_fast(row_dst,row_src,block_width,end-begin);
+            } else {
+                CP_rgb2yuv_hq  (row_dst,row_src,block_width,end-begin);
+            }
+        });
+        break;
+    case CP_GRAY:
+        CP_gray2yuv(dst,src,block_width,frame_mbHeight*2);
+        break;
+    case CP_YUVBLOCK:
+        memcpy(dst,data,4*sizeof(CPYuvBlock)*total_macroblocks());
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+// Converts only the given macroblocks, which keep their place in the frame
+void CPEncoderState::convert_rect(CPYuvBlock *dst,CPColorType ctype,const void *data,uint mb_x,uint mb_y,uint mb_width,uint mb_height) {
+    uint block_width = frame_mbWidth*2;
+    auto src = (const uint8_t *)data;
+    switch(ctype) {
+    case CP_RGB24:
+        pool->parallel_for(mb_y*2,(mb_y+mb_height)*2,convert_chunk_rows,[&](uint begin,uint end){
+            auto row_dst = dst+begin*block_width+mb_x*2;
+            auto row_src = src+(begin*block_width*2*2+mb_x*2*2)*3;
+            if (encoder_flags & CP_ENCFLAG_RGB2YUV_FAST) {
+                rgb2yuv_fast_strided(row_dst,row_src,mb_width*2,end-begin,block_width);
+            } else {
+                rgb2yuv_hq_strided  (row_dst,row_src,mb_width*2,end-begin,block_width);
+            }
+        });
+        break;
+    case CP_GRAY:
+        gray2yuv_strided(dst+mb_y*2*block_width+mb_x*2,src+mb_y*2*block_width*2*2+mb_x*2*2,mb_width*2,mb_height*2,block_width);
+        break;
+    case CP_YUVBLOCK:
+        for (uint row=mb_y*2;row<(mb_y+mb_height)*2;row++) {
+            memcpy(dst+row*block_width+mb_x*2,(const CPYuvBlock *)data+row*block_width+mb_x*2,mb_width*2*sizeof(CPYuvBlock));
+        }
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+// Input frames move up by one, next_frame is left to be overwritten
+void CPEncoderState::rotate_frames() {
+    std::swap(prev_frame,cur_frame);
+    std::swap(cur_frame,next_frame);
+}
+
 CP_API bool CP_push_frame(CPEncoderState *enc,CPColorType ctype,const void *data) {
     if (enc->frames_pushed >= 2) return false;
     enc->frames_pushed++;
-    std::swap(enc->cur_frame,enc->next_frame);
+    enc->rotate_frames();
+    std::swap(enc->cur_damage,enc->next_damage);
+    enc->next_damage.clear();
     if (data) {
-        switch(ctype) {
-        case CP_RGB24:
-            if (enc->encoder_flags & CP_ENCFLAG_RGB2YUV_FAST) {
-                CP_rgb2yuv_fast(enc->next_frame.get(),(uint8_t *)data,enc->frame_mbWidth*2,enc->frame_mbHeight*2);
-            } else {
-                CP_rgb2yuv_hq  (enc->next_frame.get(),(uint8_t *)data,enc->frame_mbWidth*2,enc->frame_mbHeight*2);
-            }
-            break;
-        case CP_GRAY:
-            CP_gray2yuv(enc->next_frame.get(),(uint8_t *)data,enc->frame_mbWidth*2,enc->frame_mbHeight*2);
-        case CP_YUVBLOCK:
-            memcpy(enc->next_frame.get(),data,4*sizeof(CPYuvBlock)*enc->total_macroblocks());
-            break;
-        default:
-            assert(false);
-            break;
-        }
+        enc->convert_frame(enc->next_frame.get(),ctype,data);
     } else {
         // Passing nullptr means "end of file"
         // .. in which case we repeat last frame
@@ -75,46 +248,339 @@ CP_API bool CP_push_frame(CPEncoderState *enc,CPColorType ctype,const void *data
     return true;
 }
 
+CP_API bool CP_push_frame_damaged(CPEncoderState *enc,CPColorType ctype,const void *data,const CPRect *rects,unsigned rect_count) {
+    // Nothing to carry the rest over from yet
+    if (enc->frame_count == 0 && enc->frames_pushed == 0) return CP_push_frame(enc,ctype,data);
+    if (enc->frames_pushed >= 2) return false;
+    enc->frames_pushed++;
+    enc->rotate_frames();
+    std::swap(enc->cur_damage,enc->next_damage);
+    memcpy(enc->next_frame.get(),enc->cur_frame.get(),4*sizeof(CPYuvBlock)*enc->total_macroblocks());
+    enc->next_damage.assign(enc->total_macroblocks(),false);
+    for (uint i=0;i<rect_count;i++) {
+        // Whole macroblocks around the rectangle
+        uint x1 = std::min(rects[i].x/4,enc->frame_mbWidth);
+        uint y1 = std::min(rects[i].y/4,enc->frame_mbHeight);
+        uint x2 = std::min((u64(rects[i].x)+rects[i].width+3)/4,u64(enc->frame_mbWidth));
+        uint y2 = std::min((u64(rects[i].y)+rects[i].height+3)/4,u64(enc->frame_mbHeight));
+        if (x1 >= x2 || y1 >= y2) continue;
+        enc->convert_rect(enc->next_frame.get(),ctype,data,x1,y1,x2-x1,y2-y1);
+        for (uint y=y1;y<y2;y++) std::fill_n(&enc->next_damage[enc->mb_index(x1,y)],x2-x1,true);
+    }
+    return true;
+}
+
 CP_API size_t CP_pull_frame(CPEncoderState *enc,uint8_t *buffer) {
     if (enc->frames_pushed < 2) return 0;
     enc->frames_pushed--;
     PacketWriter packet(buffer);
     enc->doFrame(packet);
-    assert(packet.get_length() <= CP_BUFFER_SIZE(enc->frame_mbWidth*4,enc->frame_mbHeight*4,enc->max_strips));
+    assert(packet.get_length() <= CP_BUFFER_SIZE(enc->frame_mbWidth*4,enc->frame_mbHeight*4,enc->max_tiles()));
     assert(packet.get_length() > 0);
     return packet.get_length();
 }
 
+CP_API void CP_set_queue_depth(CPEncoderState *enc,unsigned depth) {
+    // Need at least two frames to encode one
+    enc->queue_depth = std::max(2u,depth);
+}
+
+CP_API void CP_set_gop_parallel(CPEncoderState *enc,unsigned segments) {
+    enc->gop_segments = segments > 1 ? segments : 0;
+}
 
+uint64_t CPEncoderState::async_limit() {
+    // Segment mode needs all frames of the running segments plus one to fill up,
+    // and the frame waiting to be told if it's a keyframe
+    if (gop_segments) return std::max<uint64_t>(queue_depth,(gop_segments+1)*max_keyframe_interval+1);
+    return queue_depth;
+}
+
+uint64_t CPEncoderState::async_encodable() {
+    // Frames that will be encoded without further input
+    if (async_eof) return async_submitted;
+    if (async_submitted == 0) return 0;
+    // Segments end where the segmenting thread finds a keyframe.
+    // Until it has looked at every frame, more of them may still be handed out.
+    if (gop_segments) return async_scanned < async_submitted ? UINT64_MAX : async_segmented;
+    return async_submitted-1;
+}
+
+CP_API bool CP_submit_frame(CPEncoderState *enc,CPColorType ctype,const void *data) {
+    auto frame = std::make_unique<CPEncoderState::AsyncFrame>();
+    {
+        std::lock_guard<std::mutex> lock(enc->async_lock);
+        if (enc->async_eof) return false;
+        if (data && enc->async_submitted-enc->async_received >= enc->async_limit()) return false;
+        if (data && !enc->async_free_frames.empty()) {
+            frame->yuv = std::move(enc->async_free_frames.back());
+            enc->async_free_frames.pop_back();
+        }
+    }
+    frame->end_of_stream = !data;
+    if (data) {
+        if (!frame->yuv) frame->yuv = std::make_unique<CPYuvBlock[]>(enc->total_blocks());
+        frame->ctype = ctype;
+        if (ctype == CP_YUVBLOCK) {
+            enc->convert_frame(frame->yuv.get(),ctype,data);
+        } else {
+            // Copy input so caller can reuse their buffer, then convert in background
+            auto size = enc->input_size(ctype);
+            frame->input = std::make_unique<u8[]>(size);
+            memcpy(frame->input.get(),data,size);
+            auto f = frame.get();
+            enc->pool->run(f->convert_task,[enc,f](){
+                enc->convert_frame(f->yuv.get(),f->ctype,f->input.get());
+                f->input.reset();
+            });
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(enc->async_lock);
+        enc->async_frames.push_back(std::move(frame));
+        if (data) enc->async_submitted++;
+        else enc->async_eof = true;
+        if (!enc->async_thread.joinable()) {
+            enc->async_thread = std::thread([enc](){enc->async_loop();});
+        }
+    }
+    enc->async_cv.notify_all();
+    return true;
+}
+
+CP_API size_t CP_receive_packet(CPEncoderState *enc,uint8_t *buffer,bool wait) {
+    std::unique_lock<std::mutex> lock(enc->async_lock);
+    for (;;) {
+        if (!enc->async_packets.empty()) {
+            auto &packet = enc->async_packets.front();
+            size_t size = packet.size();
+            memcpy(buffer,packet.data(),size);
+            enc->async_packets.pop_front();
+            enc->async_received++;
+            return size;
+        }
+        // Don't wait for frames that can't be encoded without more input
+        if (!wait || enc->async_produced >= enc->async_encodable()) return 0;
+        enc->async_cv.wait(lock);
+    }
+}
+
+void CPEncoderState::async_loop() {
+    if (gop_segments) {
+        async_loop_segments();
+        return;
+    }
+    bool primed = false;
+    for (;;) {
+        std::unique_ptr<AsyncFrame> frame;
+        {
+            std::unique_lock<std::mutex> lock(async_lock);
+            async_cv.wait(lock,[&](){return async_quit || !async_frames.empty();});
+            if (async_quit) return;
+            frame = std::move(async_frames.front());
+            async_frames.pop_front();
+        }
+        pool->wait(frame->convert_task);
+
+        // Same as CP_push_frame, but the new frame is already converted
+        rotate_frames();
+        if (frame->end_of_stream) {
+            memcpy(next_frame.get(),cur_frame.get(),4*sizeof(CPYuvBlock)*total_macroblocks());
+        } else {
+            std::swap(next_frame,frame->yuv);
+        }
+
+        // Same as CP_pull_frame
+        std::vector<u8> buffer;
+        if (primed) {
+            buffer.resize(CP_BUFFER_SIZE(frame_mbWidth*4,frame_mbHeight*4,max_tiles()));
+            PacketWriter packet(buffer.data());
+            doFrame(packet);
+            assert(packet.get_length() <= buffer.size());
+            buffer.resize(packet.get_length());
+        }
+        {
+            std::lock_guard<std::mutex> lock(async_lock);
+            if (primed) {
+                async_packets.push_back(std::move(buffer));
+                async_produced++;
+            }
+            if (frame->yuv) async_free_frames.push_back(std::move(frame->yuv));
+        }
+        async_cv.notify_all();
+        if (frame->end_of_stream) return;
+        primed = true;
+    }
+}
+
+void CPEncoderState::async_loop_segments() {
+    // Segments start where a serial encode puts its keyframes, so the output is the same.
+    // Scene cuts depend on the frame after, so the newest frame waits for the next one to be decided on.
+    auto segment = std::make_unique<AsyncSegment>();
+    std::unique_ptr<CPYuvBlock[]> pending;
+    auto decide = [&](const CPYuvBlock *next){
+        // Same as in doFrame, a segment's frame count is the interval since its keyframe
+        uint interval = segment->frames.size();
+        bool keyframe = interval == 0 || interval >= max_keyframe_interval
+                     || (interval >= min_keyframe_interval && sceneCut(segment->frames.back().get(),pending.get(),next));
+        if (keyframe && interval > 0) {
+            // This frame starts the next segment, but the current one needs it as lookahead
+            segment->lookahead = std::make_unique<CPYuvBlock[]>(total_blocks());
+            memcpy(segment->lookahead.get(),pending.get(),total_blocks()*sizeof(CPYuvBlock));
+            launch_segment(std::move(segment));
+            segment = std::make_unique<AsyncSegment>();
+        }
+        segment->frames.push_back(std::move(pending));
+    };
+    for (;;) {
+        std::unique_ptr<AsyncFrame> frame;
+        {
+            std::unique_lock<std::mutex> lock(async_lock);
+            async_cv.wait(lock,[&](){
+                return async_quit || !async_frames.empty() || (!async_segments.empty() && async_segments.front()->done);
+            });
+            if (async_quit) return;
+            if (async_frames.empty()) {
+                // Oldest segment is done, hand out its packets
+                lock.unlock();
+                finish_segment();
+                continue;
+            }
+            frame = std::move(async_frames.front());
+            async_frames.pop_front();
+        }
+        pool->wait(frame->convert_task);
+
+        if (frame->end_of_stream) {
+            // Like CP_push_frame, the last frame is followed by a copy of itself
+            if (pending) decide(pending.get());
+            if (!segment->frames.empty()) launch_segment(std::move(segment));
+            while (!async_segments.empty()) finish_segment();
+            return;
+        }
+        if (pending) decide(frame->yuv.get());
+        pending = std::move(frame->yuv);
+        {
+            std::lock_guard<std::mutex> lock(async_lock);
+            async_scanned++;
+        }
+        async_cv.notify_all();
+    }
+}
+
+void CPEncoderState::launch_segment(std::unique_ptr<AsyncSegment> segment) {
+    {
+        std::lock_guard<std::mutex> lock(async_lock);
+        async_segmented += segment->frames.size();
+    }
+    while (async_segments.size() >= gop_segments) finish_segment();
+    auto seg = segment.get();
+    async_segments.push_back(std::move(segment));
+    seg->thread = std::thread([this,seg](){
+        encode_segment(*seg);
+        {
+            std::lock_guard<std::mutex> lock(async_lock);
+            seg->done = true;
+        }
+        async_cv.notify_all();
+    });
+}
+
+void CPEncoderState::finish_segment() {
+    // Segments are finished in order, so packets come out in order
+    auto &segment = async_segments.front();
+    segment->thread.join();
+    {
+        std::lock_guard<std::mutex> lock(async_lock);
+        for (auto &packet : segment->packets) async_packets.push_back(std::move(packet));
+        async_produced += segment->packets.size();
+    }
+    async_segments.pop_front();
+    async_cv.notify_all();
+}
+
+void CPEncoderState::encode_segment(AsyncSegment &segment) {
+    // Segment starts with a keyframe, so a fresh encoder gives the same result
+    CPEncoderState child(frame_mbWidth*4,frame_mbHeight*4,max_strips);
+    child.pool = pool;
+    child.encoder_flags = encoder_flags;
+    child.quality_factor = quality_factor;
+    child.effort = effort;
+    child.min_keyframe_interval = min_keyframe_interval;
+    child.max_keyframe_interval = max_keyframe_interval;
+    CP_set_tile_columns(&child,tile_columns);
+    for (uint i=0;i<=segment.frames.size();i++) {
+        bool last = i == segment.frames.size();
+        CP_push_frame(&child,CP_YUVBLOCK,last ? segment.lookahead.get() : segment.frames[i].get());
+        if (!last) {
+            std::lock_guard<std::mutex> lock(async_lock);
+            async_free_frames.push_back(std::move(segment.frames[i]));
+        }
+        std::vector<u8> buffer(CP_get_buffer_size(&child));
+        if (auto size = CP_pull_frame(&child,buffer.data())) {
+            buffer.resize(size);
+            segment.packets.push_back(std::move(buffer));
+        }
+    }
+}
+
+u32 CPEncoderState::mbDistortion(const CPYuvBlock *a,const CPYuvBlock *b,uint x,uint y) {
+    return blockDistortion(a[blk_index(x*2+0,y*2+0)],b[blk_index(x*2+0,y*2+0)])
+         + blockDistortion(a[blk_index(x*2+1,y*2+0)],b[blk_index(x*2+1,y*2+0)])
+         + blockDistortion(a[blk_index(x*2+0,y*2+1)],b[blk_index(x*2+0,y*2+1)])
+         + blockDistortion(a[blk_index(x*2+1,y*2+1)],b[blk_index(x*2+1,y*2+1)]);
+}
+
+// Keyframe at scene cuts, so the new scene doesn't get squeezed into inter coding.
+// A flash or burst of motion changes the next frame just as much, so it isn't a cut.
+// Both directions compare input frames, not what was encoded, so a cut can be found ahead of encoding.
+static bool isSceneCut(uint changed_mbs,uint total_mbs,u64 forward_total,u64 backward_total) {
+    return changed_mbs*100 >= total_mbs*scene_cut_changed_share
+        && forward_total*scene_cut_persistence < backward_total;
+}
+
+// doFrame's scene cut test, for whole frames outside of an encode
+bool CPEncoderState::sceneCut(const CPYuvBlock *prev,const CPYuvBlock *cur,const CPYuvBlock *next) {
+    u64 forward_total = 0,backward_total = 0;
+    uint changed_mbs = 0;
+    for (uint y=0;y<frame_mbHeight;y++) {
+        for (uint x=0;x<frame_mbWidth;x++) {
+            u32 backward = mbDistortion(cur,prev,x,y);
+            forward_total += mbDistortion(cur,next,x,y);
+            backward_total += backward;
+            if (backward >= scene_cut_mb_distortion) changed_mbs++;
+        }
+    }
+    return isSceneCut(changed_mbs,total_macroblocks(),forward_total,backward_total);
+}
 
 void CPEncoderState::doFrame(PacketWriter &packet) {
 
+    frame_start = CPClock::now();
+    deadline_cut = false;
+
     auto frame_header = packet;
     auto frame_begin = packet.ptr;
     packet.skip(10);
     
-    bool keyframe = false;
-    if (inter_frames_left == 0 || frame_count == 0) {
-        inter_frames_left = 60;
-        keyframe = true;
-    } else {
-        inter_frames_left--;
-    }
-
     // Compute bidirectional differences
+    u64 forward_total = 0,backward_total = 0;
+    uint changed_mbs = 0;
     for (uint y=0;y<frame_mbHeight;y++) {
         for (uint x=0;x<frame_mbWidth;x++) {
-            u32 forward = blockDistortion(cur_frame[blk_index(x*2+0,y*2+0)],next_frame[blk_index(x*2+0,y*2+0)])
-                        + blockDistortion(cur_frame[blk_index(x*2+1,y*2+0)],next_frame[blk_index(x*2+1,y*2+0)])
-                        + blockDistortion(cur_frame[blk_index(x*2+0,y*2+1)],next_frame[blk_index(x*2+0,y*2+1)])
-                        + blockDistortion(cur_frame[blk_index(x*2+1,y*2+1)],next_frame[blk_index(x*2+1,y*2+1)]);
-            u32 backward = keyframe ? UINT32_MAX 
-                         : blockDistortion(cur_frame[blk_index(x*2+0,y*2+0)],decode_state.frame[blk_index(x*2+0,y*2+0)])
-                         + blockDistortion(cur_frame[blk_index(x*2+1,y*2+0)],decode_state.frame[blk_index(x*2+1,y*2+0)])
-                         + blockDistortion(cur_frame[blk_index(x*2+0,y*2+1)],decode_state.frame[blk_index(x*2+0,y*2+1)])
-                         + blockDistortion(cur_frame[blk_index(x*2+1,y*2+1)],decode_state.frame[blk_index(x*2+1,y*2+1)]);
+            // Outside the damage, frames are known to be the same.
+            // The decoder keeps what it has there, so it counts as unchanged.
+            bool next_touched = next_damage.empty() || next_damage[mb_index(x,y)];
+            u32 forward = !next_touched ? 0 : mbDistortion(cur_frame.get(),next_frame.get(),x,y);
+            u32 backward = untouched(mb_index(x,y)) ? 0 : mbDistortion(cur_frame.get(),prev_frame.get(),x,y);
+            u32 skip = untouched(mb_index(x,y)) ? 0 : mbDistortion(cur_frame.get(),decode_state.frame.get(),x,y);
+            forward_total += forward;
+            backward_total += backward;
+            if (backward >= scene_cut_mb_distortion) changed_mbs++;
             
-            skip_mb_distortion[mb_index(x,y)] =  backward;
+            skip_mb_distortion[mb_index(x,y)] = skip;
+            change_mb_distortion[mb_index(x,y)] = next_change_mb_distortion[mb_index(x,y)];
+            next_change_mb_distortion[mb_index(x,y)] = forward;
             // TODO: Tune threshold
             // TODO: Re-enable
             u16 weight = 2;//forward < 16 ? 3 : 2;
@@ -125,31 +591,89 @@ void CPEncoderState::doFrame(PacketWriter &packet) {
         }
     } 
 
-    // Create low-res copy of frame for V1 encoding
-    CP_yuv_downscale_fast(cur_frame_v1.get(),cur_frame.get(),frame_mbWidth,frame_mbHeight,0);
+    uint interval = frames_since_keyframe+1;
+    bool scene_cut = isSceneCut(changed_mbs,total_macroblocks(),forward_total,backward_total);
+    bool keyframe = frame_count == 0 || interval >= max_keyframe_interval || (interval >= min_keyframe_interval && scene_cut);
+    if (keyframe) {
+        frames_since_keyframe = 0;
+        std::fill_n(skip_mb_distortion.get(),total_macroblocks(),UINT32_MAX);
+    } else {
+        frames_since_keyframe++;
+    }
+
+    // Create low-res copy of frame for V1 encoding.
+    // Rows without damage still have theirs from the last frame.
+    if (cur_damage.empty()) {
+        CP_yuv_downscale_fast(cur_frame_v1.get(),cur_frame.get(),frame_mbWidth,frame_mbHeight,0);
+    } else {
+        for (uint y=0;y<frame_mbHeight;y++) {
+            auto row = &cur_damage[mb_index(0,y)];
+            if (std::none_of(row,row+frame_mbWidth,[](u8 d){return d;})) continue;
+            CP_yuv_downscale_fast(cur_frame_v1.get()+mb_index(0,y),cur_frame.get()+blk_index(0,y*2),frame_mbWidth,1,0);
+        }
+    }
 
-    uint strips = max_strips;
-    uint y1 = 0;
+    // Damaged input is mostly unchanged, so the strips can stay as they are
+    if (keyframe || cur_damage.empty() || strip_ytop.empty()) layoutStrips(keyframe);
+    uint strips = strip_count();
+    auto run_length = shareRuns();
+    // Runs only work if strips start from the codebooks of the one before.
+    // Keyframes always do, which lets strips skip what the one above already sent.
+    bool inherit = keyframe || std::any_of(run_length.begin(),run_length.end(),[](uint n){return n > 1;});
     auto strip_buffer = std::make_unique<StripEncoding[]>(strips);
-    std::vector<std::thread> strip_threads;
-    for (uint i=0;i<strips;i++) {
-        auto height = std::min(frame_mbHeight/strips,frame_mbHeight-y1);
-        auto strip_fun = [=,&strip_buffer](){
-            strip_buffer[i] = tryStrip(y1,height,keyframe);
-        };
-        if (use_threads()) strip_threads.emplace_back(strip_fun);
-        else strip_fun();
-        y1+=height;
+    CPThreadPool::TaskGroup strip_tasks;
+    for (uint first=0;first<strips;first+=run_length[first]) {
+        uint count = run_length[first];
+        pool->run(strip_tasks,[=,&strip_buffer](){
+            if (count == 1) {
+                strip_buffer[first] = tryStrip(first,keyframe);
+                return;
+            }
+            SharedCodebooks shared;
+            trainShared(shared,first,count,keyframe);
+            CPThreadPool::TaskGroup run_tasks;
+            for (uint i=first;i<first+count;i++) {
+                pool->run(run_tasks,[=,&shared,&strip_buffer](){
+                    strip_buffer[i] = tryStrip(i,keyframe,&shared);
+                });
+            }
+            pool->wait(run_tasks);
+        });
     }
+    pool->wait(strip_tasks);
 
+    // Keyframes don't build on codewords from before, as decoding may start there
+    if (keyframe) {
+        known_slots_v1.clear();
+        known_slots_v4.clear();
+    }
+    if (known_slots_v4.size() < strips) {
+        known_slots_v1.resize(strips);
+        known_slots_v4.resize(strips);
+    }
+    // Codebooks as the decoder will have them when it gets to each strip
+    std::array<CPYuvBlock,256> book_v1 = {},book_v4 = {};
+    std::bitset<256> known_v1,known_v4;
     for (uint i=0;i<strips;i++) {
-        if (i<strip_threads.size()) strip_threads[i].join();
-        writeStrip(packet,strip_buffer[i]);
+        bool known = !keyframe && i < decode_state.codes_v4.size();
+        if (i == 0 || !inherit) {
+            book_v1 = known ? decode_state.codes_v1[i] : std::array<CPYuvBlock,256>{};
+            book_v4 = known ? decode_state.codes_v4[i] : std::array<CPYuvBlock,256>{};
+            known_v1 = known ? known_slots_v1[i] : std::bitset<256>{};
+            known_v4 = known ? known_slots_v4[i] : std::bitset<256>{};
+        }
+        // Keyframes still send full codebooks in the first strip, so decoding can start there
+        bool partial = (inherit && i > 0) || known;
+        writeStrip(packet,strip_buffer[i],book_v1,book_v4,known_v1,known_v4,partial);
+        known_slots_v1[i] = known_v1;
+        known_slots_v4[i] = known_v4;
     }
     
     
     uint framesize = packet.ptr - frame_header.ptr;
-    frame_header.write_u8(CHUNK_FRAME_INTRA);
+    // Unless strips inherit, inter frames tell the decoder to keep each strip's codebooks,
+    // instead of starting from the previous strip's, as partial updates build on them.
+    frame_header.write_u8(inherit ? CHUNK_FRAME_INTRA : CHUNK_FRAME_INTER);
     frame_header.write_u24(framesize);
     frame_header.write_u16(frame_mbWidth*4);
     frame_header.write_u16(frame_mbHeight*4);
@@ -158,6 +682,140 @@ void CPEncoderState::doFrame(PacketWriter &packet) {
     // Decode packet back into buffer
     decode_state.do_decode(frame_begin,packet.ptr - frame_begin);
     frame_count++;
+
+    u64 frame_us = std::chrono::duration_cast<std::chrono::microseconds>(CPClock::now()-frame_start).count();
+    std::lock_guard<std::mutex> lock(stats_lock);
+    stats.frames++;
+    if (deadline_cut) stats.deadline_cut++;
+    if (deadline_us && frame_us > deadline_us) stats.deadline_missed++;
+    stats.last_frame_us = frame_us;
+    stats.max_frame_us = std::max(stats.max_frame_us,frame_us);
+    stats.total_frame_us += frame_us;
+}
+
+// Each strip row is cut into tiles of equal width, numbered row by row
+void CPEncoderState::stripArea(uint strip_index,uint &xleft,uint &width,uint &ytop,uint &height) {
+    uint row = strip_index/tile_columns, column = strip_index%tile_columns;
+    ytop = strip_ytop[row];
+    height = strip_ytop[row+1]-ytop;
+    xleft = column*frame_mbWidth/tile_columns;
+    width = (column+1)*frame_mbWidth/tile_columns-xleft;
+}
+
+// Mean and spread of a strip's blocks, weighted like blockDistortion
+struct StripStats {
+    u64 count = 0;
+    std::array<u64,6> sum = {},sum_sq = {};
+
+    void add(CPYuvBlock blk) {
+        const u64 val[6] = {blk.u,blk.v,blk.ytl,blk.ytr,blk.ybl,blk.ybr};
+        for (uint c=0;c<6;c++) {
+            sum[c] += val[c];
+            sum_sq[c] += val[c]*val[c];
+        }
+        count++;
+    }
+    void add(const StripStats &other) {
+        for (uint c=0;c<6;c++) {
+            sum[c] += other.sum[c];
+            sum_sq[c] += other.sum_sq[c];
+        }
+        count += other.count;
+    }
+    static constexpr double weight[6] = {U_WEIGHT,V_WEIGHT,Y_WEIGHT,Y_WEIGHT,Y_WEIGHT,Y_WEIGHT};
+    double mean(uint c) const {return double(sum[c])/count;}
+    double spread() const {
+        double total = 0;
+        for (uint c=0;c<6;c++) total += weight[c]*(double(sum_sq[c])/count - mean(c)*mean(c));
+        return total;
+    }
+    double mean_distance(const StripStats &other) const {
+        double total = 0;
+        for (uint c=0;c<6;c++) total += weight[c]*(mean(c)-other.mean(c))*(mean(c)-other.mean(c));
+        return total;
+    }
+};
+
+// Runs of neighbouring strips that are alike enough to share codebooks.
+// Gives the length of the run starting at each strip (only meaningful at run starts).
+std::vector<uint> CPEncoderState::shareRuns() {
+    uint strips = strip_count();
+    std::vector<uint> run_length(strips,1);
+    if (!(encoder_flags & CP_ENCFLAG_SHARE_CODEBOOKS)) return run_length;
+    std::vector<StripStats> stats(strips);
+    for (uint i=0;i<strips;i++) {
+        uint xleft,width,ytop,height;
+        stripArea(i,xleft,width,ytop,height);
+        for (uint y=ytop*2;y<(ytop+height)*2;y++) {
+            for (uint x=xleft*2;x<(xleft+width)*2;x++) stats[i].add(cur_frame[blk_index(x,y)]);
+        }
+    }
+    uint first = 0;
+    StripStats run = stats[0];
+    for (uint i=1;i<strips;i++) {
+        double spread_a = run.spread(),spread_b = stats[i].spread();
+        double spread_min = std::min(spread_a,spread_b),spread_max = std::max(spread_a,spread_b);
+        bool alike = run.mean_distance(stats[i])*100 <= (spread_a+spread_b)/2*share_mean_tolerance + share_slack*100
+                  && spread_max*100 <= spread_min*share_spread_tolerance + share_slack*100;
+        if (alike) {
+            run_length[first]++;
+            run.add(stats[i]);
+        } else {
+            first = i;
+            run = stats[i];
+        }
+    }
+    return run_length;
+}
+
+// Pick strip count and boundaries so that every strip has about the same VQ work
+void CPEncoderState::layoutStrips(bool keyframe) {
+    std::vector<u64> row_cost(frame_mbHeight);
+    u64 total_cost = 0,total_detail = 0;
+    for (uint y=0;y<frame_mbHeight;y++) {
+        for (uint x=0;x<frame_mbWidth;x++) {
+            u32 detail = macroblockV1Distortion(
+                cur_frame[blk_index(x*2+0,y*2+0)],
+                cur_frame[blk_index(x*2+1,y*2+0)],
+                cur_frame[blk_index(x*2+0,y*2+1)],
+                cur_frame[blk_index(x*2+1,y*2+1)],
+                cur_frame_v1[mb_index(x,y)]);
+            detail = std::min(detail,strip_detail_cap);
+            row_cost[y] += strip_base_cost + detail;
+            total_detail += detail;
+        }
+        total_cost += row_cost[y];
+    }
+    // Flat frames don't need a codebook pair per strip.
+    // Between keyframes, the count only moves when it's off by more than one.
+    uint strips = std::clamp<u64>((total_detail+strip_min_detail-1)/strip_min_detail,1,std::min(max_strips,frame_mbHeight));
+    uint prev_strips = strip_ytop.size()-1;
+    if (!keyframe && !strip_ytop.empty() && strips+1 >= prev_strips && strips <= prev_strips+1) strips = prev_strips;
+
+    // Cut where the running cost passes each strip's share, at least a row per strip
+    std::vector<uint> layout(strips+1);
+    layout[0] = 0;
+    layout[strips] = frame_mbHeight;
+    u64 cost = 0;
+    uint y = 0;
+    for (uint i=1;i<strips;i++) {
+        do cost += row_cost[y++];
+        while (y < frame_mbHeight-(strips-i) && cost*strips < total_cost*i);
+        layout[i] = y;
+    }
+
+    auto max_strip_cost = [&](const std::vector<uint> &ytop){
+        u64 max_cost = 0;
+        for (uint i=0;i+1<ytop.size();i++) {
+            max_cost = std::max(max_cost,std::accumulate(row_cost.begin()+ytop[i],row_cost.begin()+ytop[i+1],u64(0)));
+        }
+        return max_cost;
+    };
+    // Moving strips costs codebook reuse, so only do it for a real improvement.
+    // Keyframes reuse nothing, so they always take the new layout.
+    if (!keyframe && strip_ytop.size() == layout.size()
+     && max_strip_cost(strip_ytop)*100 <= max_strip_cost(layout)*(100+strip_relayout_slack)) return;
+    strip_ytop = std::move(layout);
 }
 
 [[maybe_unused]]
@@ -176,49 +834,207 @@ static void printCBInfo(const std::vector<CPYuvBlock> codebook,const u8 *indices
 
 }
 
+// Start from the previous frame's codebook instead of running PNN,
+// unless the scene changed so much that it no longer fits.
+bool CPEncoderState::warmStart(std::vector<CPYuvBlock> &codebook,const std::vector<CPYuvBlock> &prev_codes,u64 prev_distortion,const TrainingSet &set) {
+    if (prev_codes.empty() || set.count == 0) return false;
+    // Gray content should get a gray codebook, which a color one won't turn into
+    if (set.mono && !std::all_of(prev_codes.begin(),prev_codes.end(),isGray)) return false;
+    auto partition = acquire_partition();
+    partition->label.resize(set.count);
+    u64 code_distortion[256] = {};
+    u64 distortion = voronoi_partition(prev_codes,set,0,set.count,code_distortion,partition->label.data(),pool.get());
+    release_partition(std::move(partition));
+    if (distortion > (prev_distortion*warm_start_tolerance/100 + warm_start_slack)*set.source_count) return false;
+    codebook = prev_codes;
+    return true;
+}
+
+// Pick the codebook first training starts from
+void CPEncoderState::initCodebook(std::vector<CPYuvBlock> &codebook,const std::vector<CPYuvBlock> &prev_codes,u64 prev_distortion,
+    const TrainingSet &set,std::vector<u8> *closest_out,bool keyframe,CPClock::time_point deadline
+) {
+    // Keyframes always train from scratch, so they don't depend on earlier frames
+    if (!keyframe && warmStart(codebook,prev_codes,prev_distortion,set)) return;
+    if (effort.pnn_init) {
+        // PNN can't stop halfway, so in real-time mode it only runs
+        // if it should be done in time, judging by the last run.
+        auto estimate = std::chrono::nanoseconds(pnn_ns_per_vector*set.count);
+        if (!deadline_us || CPClock::now() + estimate < deadline) {
+            auto start = CPClock::now();
+            vq_fastpnn(codebook,256,set,closest_out);
+            pnn_ns_per_vector = (CPClock::now()-start).count()/std::max(1u,set.count);
+            return;
+        }
+        deadline_cut = true;
+        // Even a badly fitting full codebook is a better start than a single codeword
+        if (!prev_codes.empty()) {
+            codebook = prev_codes;
+            return;
+        }
+    }
+    codebook.clear();
+}
+
+// In real-time mode, strips that don't all fit on the pool at once split the time.
+// A run of strips gets the windows of all its strips.
+void CPEncoderState::stripDeadlines(uint strip_index,uint count,CPClock::time_point &train_deadline,CPClock::time_point &retrain_deadline) {
+    train_deadline = CPClock::time_point::max();
+    retrain_deadline = CPClock::time_point::max();
+    if (!deadline_us) return;
+    uint threads = pool->worker_count()+1;
+    uint rounds = (strip_count()+threads-1)/threads;
+    u64 round_us = u64(deadline_us)*strip_time_share/100/rounds;
+    uint first_round = strip_index/threads, last_round = (strip_index+count-1)/threads;
+    u64 window_us = round_us*(last_round-first_round+1);
+    auto window_start = frame_start + std::chrono::microseconds(round_us*first_round);
+    train_deadline = window_start + std::chrono::microseconds(window_us*train_time_share/100);
+    retrain_deadline = window_start + std::chrono::microseconds(window_us);
+}
+
+// Labels every training vector with its nearest codeword, returns the total distortion
+u64 CPEncoderState::assignCodebook(const std::vector<CPYuvBlock> &codebook,const TrainingSet &set,std::vector<u8> &closest_out) {
+    auto partition = acquire_partition();
+    partition->label.resize(set.count);
+    u64 code_distortion[256] = {};
+    u64 distortion = voronoi_partition(codebook,set,0,set.count,code_distortion,partition->label.data(),pool.get());
+    for (uint n=0;n<set.count;n++) closest_out[set.indices[n]] = partition->label[n];
+    set.expand_labels(closest_out);
+    release_partition(std::move(partition));
+    return distortion;
+}
+
+// Whether training can leave out a macroblock. Never true on keyframes, as they don't skip.
+bool CPEncoderState::isStill(uint mb) {
+    return change_mb_distortion[mb] <= still_change_distortion && skip_mb_distortion[mb] <= still_skip_distortion;
+}
+
+// Trains one pair of codebooks on all strips of a run
+void CPEncoderState::trainShared(SharedCodebooks &shared,uint first,uint count,bool keyframe) {
+    CPClock::time_point train_deadline,retrain_deadline;
+    stripDeadlines(first,count,train_deadline,retrain_deadline);
+    // Indexed from the frame's top left, as strips of a run don't have to be next to each other in memory.
+    // Like in single strips, only macroblocks that changed are trained on.
+    std::vector<uint> v4_idx,v1_idx;
+    for (bool all : {false,true}) {
+        for (uint i=first;i<first+count;i++) {
+            uint xleft,width,ytop,height;
+            stripArea(i,xleft,width,ytop,height);
+            for (uint y=ytop;y<ytop+height;y++) for (uint x=xleft;x<xleft+width;x++) {
+                if (!all && isStill(mb_index(x,y))) continue;
+                v1_idx.push_back(mb_index(x,y));
+                v4_idx.push_back(blk_index(x*2+0,y*2+0));
+                v4_idx.push_back(blk_index(x*2+1,y*2+0));
+                v4_idx.push_back(blk_index(x*2+0,y*2+1));
+                v4_idx.push_back(blk_index(x*2+1,y*2+1));
+            }
+        }
+        // Nothing changed enough, so train on all of it unless there's a codebook to keep
+        if (!v1_idx.empty() || !prev_codes_v4[first].empty()) break;
+    }
+    if (v1_idx.empty()) {
+        shared.code_v1 = prev_codes_v1[first];
+        shared.code_v4 = prev_codes_v4[first];
+        return;
+    }
+    TrainingSet v4_set,v1_set;
+    CPThreadPool::TaskGroup v1_task;
+    pool->run(v1_task,[&](){
+        v1_set.gather(cur_frame_v1.get(),v1_idx);
+        initCodebook(shared.code_v1,prev_codes_v1[first],prev_distortion_v1[first],v1_set,nullptr,keyframe,train_deadline);
+        vq_elbg(shared.code_v1,256,v1_set,nullptr,train_deadline);
+    });
+    v4_set.gather(cur_frame.get(),v4_idx);
+    initCodebook(shared.code_v4,prev_codes_v4[first],prev_distortion_v4[first],v4_set,nullptr,keyframe,train_deadline);
+    vq_elbg(shared.code_v4,256,v4_set,nullptr,train_deadline);
+    pool->wait(v1_task);
+}
+
 CPEncoderState::StripEncoding
-CPEncoderState::tryStrip(uint ytop, uint height, bool keyframe) {
+CPEncoderState::tryStrip(uint strip_index, bool keyframe, const SharedCodebooks *shared) {
+    uint xleft,width,ytop,height;
+    stripArea(strip_index,xleft,width,ytop,height);
+    // Per-macroblock data keeps the frame's row stride, so tiles index it just like full strips
     CPEncoderState::StripEncoding strip(frame_mbWidth*height);
+    strip.xleft = xleft;
+    strip.width = width;
     strip.ytop = ytop;
     strip.height = height;
-    uint strip_macroblocks = height*frame_mbWidth;
+    uint strip_macroblocks = height*width;
+
+    auto image_v4 = cur_frame.get()+blk_index(xleft*2,ytop*2);
+    auto image_v1 = cur_frame_v1.get()+mb_index(xleft,ytop);
 
-    auto image_v4 = cur_frame.get()+blk_index(0,ytop*2);
-    auto image_v1 = cur_frame_v1.get()+mb_index(0,ytop);
+    CPClock::time_point train_deadline,retrain_deadline;
+    stripDeadlines(strip_index,1,train_deadline,retrain_deadline);
 
     std::vector<uint> v4_idx,v1_idx;
+    // Macroblocks that barely changed, left out of training
+    std::vector<uint> v4_still_idx,v1_still_idx;
+    // Staging buffers, gathered again whenever the index lists change
+    TrainingSet v4_set,v1_set;
     bool frame_skip = !keyframe;
-    for (uint i=0;i<strip_macroblocks;i++) {
-        strip.mb_types[i] = CPEncoderState::StripEncoding::MB_V4;
-        auto skip_dist = skip_mb_distortion[ytop*frame_mbWidth+i];
+    // Macroblocks outside the damage are always skipped, so the strip has to be inter coded
+    auto forced_skip = [&](uint x,uint y){return !keyframe && untouched(mb_index(xleft+x,ytop+y));};
+    bool any_forced_skip = false;
+    for (uint y=0;y<height;y++) for (uint x=0;x<width;x++) {
+        strip.mb_types[mb_index(x,y)] = CPEncoderState::StripEncoding::MB_V4;
+        auto skip_dist = skip_mb_distortion[mb_index(xleft+x,ytop+y)];
         if (skip_dist>0) frame_skip = false;
-        if (skip_dist>0 || keyframe || true) {
-            // Funny optimization wherein we ignore unchanged macroblocks
-            // TODO disabled because it destroys quality
-            v1_idx.push_back(i);
-            v4_idx.push_back(i*4+0);
-            v4_idx.push_back(i*4+1);
-            v4_idx.push_back(i*4+2);
-            v4_idx.push_back(i*4+3);
+        if (forced_skip(x,y)) {
+            any_forced_skip = true;
+            continue;
         }
+        bool still = isStill(mb_index(xleft+x,ytop+y));
+        auto &mb_idx = still ? v1_still_idx : v1_idx;
+        auto &blk_idx = still ? v4_still_idx : v4_idx;
+        mb_idx.push_back(mb_index(x,y));
+        blk_idx.push_back(blk_index(x*2+0,y*2+0));
+        blk_idx.push_back(blk_index(x*2+1,y*2+0));
+        blk_idx.push_back(blk_index(x*2+0,y*2+1));
+        blk_idx.push_back(blk_index(x*2+1,y*2+1));
     }
+
+    // Trains on the macroblocks that changed, so VQ work follows the amount of change.
+    // The still ones get their nearest codewords looked up, so mode decision sees them as before.
+    auto train = [&](std::vector<CPYuvBlock> &codebook,const std::vector<CPYuvBlock> *shared_codes,
+        std::vector<CPYuvBlock> &prev_codes,u64 &prev_distortion,TrainingSet &set,const CPYuvBlock *image,
+        const std::vector<uint> &idx,const std::vector<uint> &still_idx,std::vector<u8> &closest
+    ) {
+        // Nothing changed enough, so train on all of it unless there's a codebook to keep
+        bool train_all = idx.empty() && !shared_codes && prev_codes.empty();
+        set.gather(image,train_all ? still_idx : idx);
+        if (shared_codes) {
+            // Codebooks of the run only need to be looked up
+            codebook = *shared_codes;
+            if (set.count) prev_distortion = assignCodebook(codebook,set,closest)/set.source_count;
+        } else if (set.count == 0) {
+            codebook = prev_codes;
+        } else {
+            initCodebook(codebook,prev_codes,prev_distortion,set,&closest,keyframe,train_deadline);
+            prev_distortion = vq_elbg(codebook,256,set,&closest,train_deadline)/set.source_count;
+        }
+        prev_codes = codebook;
+        if (train_all || still_idx.empty()) return;
+        set.gather(image,still_idx);
+        assignCodebook(codebook,set,closest);
+    };
+
     if (frame_skip) {
         // Special case for fully unchanged frame
         strip.strip_type = CPEncoderState::StripEncoding::MB_SKIP;
-        for (uint i=0;i<strip_macroblocks;i++) strip.mb_types[i] = CPEncoderState::StripEncoding::MB_SKIP;
+        for (uint y=0;y<height;y++) for (uint x=0;x<width;x++) strip.mb_types[mb_index(x,y)] = CPEncoderState::StripEncoding::MB_SKIP;
         v1_idx.clear();
         v4_idx.clear();
     } else {
-        auto v1_proc = [&](){
-            vq_fastpnn(strip.code_v1,256,image_v1,v1_idx,&strip.mb_v1);
-            vq_elbg(strip.code_v1,256,image_v1,v1_idx,&strip.mb_v1);
-        };
-        std::optional<std::thread> v1_thread;
-        if (use_threads()) v1_thread = std::thread(v1_proc);
-        else v1_proc();
-        vq_fastpnn(strip.code_v4,256,image_v4,v4_idx,&strip.blk_v4);
-        vq_elbg(strip.code_v4,256,image_v4,v4_idx,&strip.blk_v4);
-        if (v1_thread) v1_thread.value().join();
+        CPThreadPool::TaskGroup v1_task;
+        pool->run(v1_task,[&](){
+            train(strip.code_v1,shared ? &shared->code_v1 : nullptr,prev_codes_v1[strip_index],prev_distortion_v1[strip_index],
+                v1_set,image_v1,v1_idx,v1_still_idx,strip.mb_v1);
+        });
+        train(strip.code_v4,shared ? &shared->code_v4 : nullptr,prev_codes_v4[strip_index],prev_distortion_v4[strip_index],
+            v4_set,image_v4,v4_idx,v4_still_idx,strip.blk_v4);
+        pool->wait(v1_task);
 
         v4_idx.clear();
         v1_idx.clear();
@@ -231,7 +1047,11 @@ CPEncoderState::tryStrip(uint ytop, uint height, bool keyframe) {
         u32 inter_v4_cost = 34*TOTAL_WEIGHT*quality_factor;
         u32 inter_skip_cost = 1*TOTAL_WEIGHT*quality_factor;
         for (uint y=0;y<height;y++) {
-            for (uint x=0;x<frame_mbWidth;x++) {
+            for (uint x=0;x<width;x++) {
+                if (forced_skip(x,y)) {
+                    strip.mb_types[mb_index(x,y)] = CPEncoderState::StripEncoding::MB_SKIP;
+                    continue;
+                }
                 u32 v1_distortion = macroblockV1Distortion(
                     image_v4[blk_index(x*2+0,y*2+0)],
                     image_v4[blk_index(x*2+1,y*2+0)],
@@ -243,7 +1063,7 @@ CPEncoderState::tryStrip(uint ytop, uint height, bool keyframe) {
                                 + blockDistortion(image_v4[blk_index(x*2+0,y*2+1)],strip.code_v4[strip.blk_v4[blk_index(x*2+0,y*2+1)]])
                                 + blockDistortion(image_v4[blk_index(x*2+1,y*2+1)],strip.code_v4[strip.blk_v4[blk_index(x*2+1,y*2+1)]]);
                 
-                u32 skip_distortion = skip_mb_distortion[mb_index(x,ytop+y)];
+                u32 skip_distortion = skip_mb_distortion[mb_index(xleft+x,ytop+y)];
 
                 u32 v1only_score =       v1_distortion*QUALITY_SCALE + v1only_cost;
                 u32 intra_v1_score =     v1_distortion*QUALITY_SCALE + intra_v1_cost;
@@ -279,17 +1099,18 @@ CPEncoderState::tryStrip(uint ytop, uint height, bool keyframe) {
             }
         }
         // Evalutate scores
-        if (v1only_score_total <= inter_score_total && (keyframe || v1only_score_total <= intra_score_total)) {
+        if (!any_forced_skip && v1only_score_total <= inter_score_total && (keyframe || v1only_score_total <= intra_score_total)) {
             // Convert to V1 only
             strip.strip_type = CPEncoderState::StripEncoding::MB_V1;
             v4_idx.clear();
-            for (uint i=0;i<strip_macroblocks;i++) {
+            for (uint y=0;y<height;y++) for (uint x=0;x<width;x++) {
+                uint i = mb_index(x,y);
                 if (strip.mb_types[i] != CPEncoderState::StripEncoding::MB_V1) {
                     strip.mb_types[i] = CPEncoderState::StripEncoding::MB_V1;
                     v1_idx.push_back(i);
                 }
             }
-        } else if (inter_score_total < intra_score_total && !keyframe) {
+        } else if ((any_forced_skip || inter_score_total < intra_score_total) && !keyframe) {
             // Use inter coding
             strip.strip_type = CPEncoderState::StripEncoding::MB_SKIP;
         } else {
@@ -297,32 +1118,46 @@ CPEncoderState::tryStrip(uint ytop, uint height, bool keyframe) {
             strip.strip_type = CPEncoderState::StripEncoding::MB_V4;
             if (!keyframe) {
                 // Keyframe already doesn't have inter coding
-                for (uint i=0;i<strip_macroblocks;i++) {
+                for (uint y=0;y<height;y++) for (uint x=0;x<width;x++) {
+                    uint i = mb_index(x,y);
                     if (strip.mb_types[i] == CPEncoderState::StripEncoding::MB_SKIP_ELSE_V1) {
                         strip.mb_types[i] = CPEncoderState::StripEncoding::MB_V1;
                         v1_idx.push_back(i);
                     } else if (strip.mb_types[i] == CPEncoderState::StripEncoding::MB_SKIP) {
                         strip.mb_types[i] = CPEncoderState::StripEncoding::MB_V4;
-                        v4_idx.push_back(i*4);
-                        v4_idx.push_back(i*4+1);
-                        v4_idx.push_back(i*4+frame_mbWidth*2);
-                        v4_idx.push_back(i*4+frame_mbWidth*2+1);
+                        v4_idx.push_back(blk_index(x*2+0,y*2+0));
+                        v4_idx.push_back(blk_index(x*2+1,y*2+0));
+                        v4_idx.push_back(blk_index(x*2+0,y*2+1));
+                        v4_idx.push_back(blk_index(x*2+1,y*2+1));
                     }
                 }
             }
         }
     }
     fprintf(stderr,"V1: %u, V4 : %u, SKIP: %u, %s\n",uint(v1_idx.size()),uint(v4_idx.size()/4),uint(strip_macroblocks-(v1_idx.size()+v4_idx.size()/4)),keyframe ? "KEY" : "");
-    if (v4_idx.empty()) {
-        strip.code_v4.clear();
-    } else {
-        vq_elbg(strip.code_v4,256,image_v4,v4_idx,&strip.blk_v4);
+    // Without retraining, the codebooks trained on the whole strip are used as they are.
+    // Strips of a run keep the shared ones, so the decoder can carry them over.
+    bool retrain = effort.retrain && !shared;
+    if (retrain && CPClock::now() >= retrain_deadline) {
+        retrain = false;
+        deadline_cut = true;
     }
+    CPThreadPool::TaskGroup v1_task;
     if (v1_idx.empty()) {
         strip.code_v1.clear();
-    } else {
-        vq_elbg(strip.code_v1,256,image_v1,v1_idx,&strip.mb_v1);
+    } else if (retrain) {
+        pool->run(v1_task,[&](){
+            v1_set.gather(image_v1,v1_idx);
+            vq_elbg(strip.code_v1,256,v1_set,&strip.mb_v1,retrain_deadline);
+        });
     }
+    if (v4_idx.empty()) {
+        strip.code_v4.clear();
+    } else if (retrain) {
+        v4_set.gather(image_v4,v4_idx);
+        vq_elbg(strip.code_v4,256,v4_set,&strip.blk_v4,retrain_deadline);
+    }
+    pool->wait(v1_task);
 
     #if 0
     fprintf(stderr,"V4 info:\n");
@@ -337,36 +1172,102 @@ CPEncoderState::tryStrip(uint ytop, uint height, bool keyframe) {
     return strip;
 }
 
-void CPEncoderState::writeCodebook(PacketWriter &packet,std::vector<CPYuvBlock> book,bool isV4) {
+static inline bool sameCodeword(CPYuvBlock a,CPYuvBlock b) {
+    return a.u == b.u && a.v == b.v && a.ytl == b.ytl && a.ytr == b.ytr && a.ybl == b.ybl && a.ybr == b.ybr;
+}
+
+template<typename W>
+static inline void writeCodeword(W &out,CPYuvBlock code,bool mono) {
+    out.write_u8(code.ytl);
+    out.write_u8(code.ytr);
+    out.write_u8(code.ybl);
+    out.write_u8(code.ybr);
+    if (mono) return;
+    out.write_u8(code.u^128);
+    out.write_u8(code.v^128);
+}
+
+void CPEncoderState::writeCodebook(PacketWriter &packet,const std::vector<CPYuvBlock> &book,bool isV4,std::array<CPYuvBlock,256> &decoder_book,
+    std::bitset<256> &known,bool partial,u8 *indices,uint index_count) {
+    // A codebook that is all gray can leave out the chroma bytes
+    bool mono = std::all_of(book.begin(),book.end(),isGray);
+    uint entry_size = mono ? 4 : 6;
+    u8 chunk_type = (isV4 ? CHUNK_V4_COLOR_FULL : CHUNK_V1_COLOR_FULL) | (mono ? CB_MONO_MASK : 0);
+    if (partial && !book.empty()) {
+        // Codewords the decoder already has keep their slots, new ones go into free slots.
+        // Only known slots can match, others may hold anything in a decoder that started at a keyframe.
+        // Indices beyond the codebook are stale and never written, so they map to themselves.
+        std::array<u8,256> slot;
+        std::iota(slot.begin(),slot.end(),0);
+        std::array<bool,256> taken = {},changed = {};
+        std::vector<uint> fresh;
+        for (uint i=0;i<book.size();i++) {
+            uint j = 0;
+            while (j < 256 && (taken[j] || !known[j] || !sameCodeword(book[i],decoder_book[j]))) j++;
+            if (j < 256) {
+                slot[i] = j;
+                taken[j] = true;
+            } else fresh.push_back(i);
+        }
+        uint free_slot = 0,slot_end = 0;
+        for (uint i : fresh) {
+            while (taken[free_slot]) free_slot++;
+            slot[i] = free_slot;
+            taken[free_slot] = true;
+            changed[free_slot] = true;
+            slot_end = free_slot+1;
+        }
+        // One flag word per 32 slots up to the last changed one
+        size_t partial_size = (slot_end+31)/32*4 + fresh.size()*entry_size;
+        if (partial_size < book.size()*entry_size) {
+            for (uint k=0;k<index_count;k++) indices[k] = slot[indices[k]];
+            if (fresh.empty()) return; // Decoder has all of it already
+            std::array<CPYuvBlock,256> slotted;
+            for (uint i=0;i<book.size();i++) slotted[slot[i]] = book[i];
+            auto header = packet;
+            packet.skip(4);
+            BitstreamWriter bitstream(packet);
+            for (uint j=0;j<slot_end;j++) {
+                bitstream.put_bit(changed[j]);
+                if (!changed[j]) continue;
+                writeCodeword(bitstream,slotted[j],mono);
+            }
+            bitstream.flush();
+            uint size = packet.ptr - header.ptr;
+            header.write_u8(chunk_type|CB_PARTIAL_MASK);
+            header.write_u24(size);
+            for (uint j=0;j<slot_end;j++) if (changed[j]) {
+                decoder_book[j] = slotted[j];
+                known[j] = true;
+            }
+            return;
+        }
+    }
     auto header = packet;
     packet.skip(4);
-    for (uint i=0;i<book.size();i++) {
-        auto code = book[i];
-        packet.write_u8(code.ytl);
-        packet.write_u8(code.ytr);
-        packet.write_u8(code.ybl);
-        packet.write_u8(code.ybr);
-        packet.write_u8(code.u^128);
-        packet.write_u8(code.v^128);
-    }
+    for (auto code : book) writeCodeword(packet,code,mono);
     uint size = packet.ptr - header.ptr;
-    header.write_u8(isV4 ? CHUNK_V4_COLOR_FULL : CHUNK_V1_COLOR_FULL);
+    header.write_u8(chunk_type);
     header.write_u24(size);
+    std::copy(book.begin(),book.end(),decoder_book.begin());
+    for (uint j=0;j<book.size();j++) known[j] = true;
 }
 
-void CPEncoderState::writeStrip(PacketWriter &packet,StripEncoding &strip) {
+void CPEncoderState::writeStrip(PacketWriter &packet,StripEncoding &strip,std::array<CPYuvBlock,256> &book_v1,std::array<CPYuvBlock,256> &book_v4,
+    std::bitset<256> &known_v1,std::bitset<256> &known_v4,bool partial) {
     // Write strip header later
     auto strip_header = packet;
     packet.skip(12);
 
-    writeCodebook(packet,strip.code_v1,false);
-    writeCodebook(packet,strip.code_v4,true);
+    // Partial updates only send codewords the decoder doesn't have yet
+    writeCodebook(packet,strip.code_v1,false,book_v1,known_v1,partial,strip.mb_v1.data(),strip.mb_v1.size());
+    writeCodebook(packet,strip.code_v4,true,book_v4,known_v4,partial,strip.blk_v4.data(),strip.blk_v4.size());
 
     auto image_header = packet;
     packet.skip(4);
     BitstreamWriter bitstream(packet);
     for(uint y=0;y<strip.height;y++) {
-        for(uint x=0;x<frame_mbWidth;x++) {
+        for(uint x=0;x<strip.width;x++) {
             switch (strip.mb_types[mb_index(x,y)]) {
             case CPEncoderState::StripEncoding::MB_V1:
                 if (strip.strip_type >= CPEncoderState::StripEncoding::MB_SKIP) bitstream.put_bit(true);
@@ -403,7 +1304,7 @@ void CPEncoderState::writeStrip(PacketWriter &packet,StripEncoding &strip) {
     strip_header.write_u8(strip.strip_type >= CPEncoderState::StripEncoding::MB_SKIP ? CHUNK_STRIP_INTER : CHUNK_STRIP_INTRA);
     strip_header.write_u24(stripsize);
     strip_header.write_u16(strip.ytop*4);
-    strip_header.write_u16(0);
+    strip_header.write_u16(strip.xleft*4);
     strip_header.write_u16((strip.ytop+strip.height)*4);
-    strip_header.write_u16(frame_mbWidth*4);
+    strip_header.write_u16((strip.xleft+strip.width)*4);
 }
\ No newline at end of file
@@ -38,22 +38,26 @@ CP_API void CP_yuv2gray(uint8_t* dst, const CPYuvBlock *src, unsigned blockWidth
     }
 }
 
-CP_API void CP_gray2yuv(CPYuvBlock *dst, const uint8_t* src, unsigned blockWidth, unsigned blockHeight) {
+void gray2yuv_strided(CPYuvBlock *dst, const uint8_t* src, uint blockWidth, uint blockHeight, uint stride) {
     for (uint row=0;row<blockHeight;row++) {
         for (uint column=0;column<blockWidth;column++) {
-            auto *block = dst++;
-            auto srcrow = src+(column+row*blockWidth*2)*2;
+            auto *block = dst+column+row*stride;
+            auto srcrow = src+(column+row*stride*2)*2;
             block->u = 128;
             block->v = 128;
             block->ytl = srcrow[0];
             block->ytr = srcrow[1];
-            srcrow += blockWidth*2;
+            srcrow += stride*2;
             block->ybl = srcrow[0];
             block->ybr = srcrow[1];
         }
     }
 }
 
+CP_API void CP_gray2yuv(CPYuvBlock *dst, const uint8_t* src, unsigned blockWidth, unsigned blockHeight) {
+    gray2yuv_strided(dst,src,blockWidth,blockHeight,blockWidth);
+}
+
 constexpr int mat_shift = 20;
 constexpr int mat_scale = 1<<mat_shift;
 constexpr int mat_round = mat_scale>>1;
@@ -63,19 +67,19 @@ constexpr std::array<int,9> yuv_matrix = {
     int(+0.3571*mat_scale),int(-0.2857*mat_scale),int(-0.0714*mat_scale), // RGB -> V
 };
 
-CP_API void CP_rgb2yuv_fast(CPYuvBlock *dst, const uint8_t* src, unsigned blockWidth, unsigned blockHeight) {
+void rgb2yuv_fast_strided(CPYuvBlock *dst, const uint8_t* src, uint blockWidth, uint blockHeight, uint stride) {
     // "Fast" RGB2YUV
     for (uint row=0;row<blockHeight;row++) {
         for (uint column=0;column<blockWidth;column++) {
-            auto *block = dst++;
+            auto *block = dst+column+row*stride;
             int r = 0,g = 0,b = 0;
-            auto srcrow = src+(column+row*blockWidth*2)*6;
+            auto srcrow = src+(column+row*stride*2)*6;
             block->ytl = (srcrow[0]*yuv_matrix[0] + srcrow[1]*yuv_matrix[1] + srcrow[2]*yuv_matrix[2] + mat_round) >> mat_shift;
             r         +=  srcrow[0]; g          +=  srcrow[1]; b          +=  srcrow[2];
 
             block->ytr = (srcrow[3]*yuv_matrix[0] + srcrow[4]*yuv_matrix[1] + srcrow[5]*yuv_matrix[2] + mat_round) >> mat_shift;
             r         +=  srcrow[3]; g          +=  srcrow[4]; b          +=  srcrow[5];
-            srcrow += blockWidth*2*3;
+            srcrow += stride*2*3;
             block->ybl = (srcrow[0]*yuv_matrix[0] + srcrow[1]*yuv_matrix[1] + srcrow[2]*yuv_matrix[2] + mat_round) >> mat_shift;
             r         +=  srcrow[0]; g          +=  srcrow[1]; b          +=  srcrow[2];
 
@@ -88,6 +92,10 @@ CP_API void CP_rgb2yuv_fast(CPYuvBlock *dst, const uint8_t* src, unsigned blockW
     }
 }
 
+CP_API void CP_rgb2yuv_fast(CPYuvBlock *dst, const uint8_t* src, unsigned blockWidth, unsigned blockHeight) {
+    rgb2yuv_fast_strided(dst,src,blockWidth,blockHeight,blockWidth);
+}
+
 static constexpr int Y_FIX = 2;
 static constexpr int Y_MAX = 255<<Y_FIX;
 static constexpr int Y_ROUND = (1<<Y_FIX)>>1;
@@ -124,21 +132,21 @@ static inline int srgb_avg(int a, int b, int c, int d) {
 }
 
 
-CP_API void CP_rgb2yuv_hq(CPYuvBlock *dst, const uint8_t* src, unsigned blockWidth, unsigned blockHeight) {
+void rgb2yuv_hq_strided(CPYuvBlock *dst, const uint8_t* src, uint blockWidth, uint blockHeight, uint stride) {
     // "High Quality" RGB2YUV with luma correction
     for (uint row=0;row<blockHeight;row++) {
         for (uint column=0;column<blockWidth;column++) {
-            auto *block = dst++;
+            auto *block = dst+column+row*stride;
             int r[4],g[4],b[4]; 
             int rdiff,gdiff,bdiff;
             int avg_y;
             int y[4];
             float w_target[4]; // computed real luminance value of pixels
 
-            auto srcrow = src+(column+row*blockWidth*2)*6;
+            auto srcrow = src+(column+row*stride*2)*6;
             r[0] = srcrow[0]<<Y_FIX;g[0] = srcrow[1]<<Y_FIX;b[0] = srcrow[2]<<Y_FIX;
             r[1] = srcrow[3]<<Y_FIX;g[1] = srcrow[4]<<Y_FIX;b[1] = srcrow[5]<<Y_FIX;
-            srcrow += blockWidth*2*3;
+            srcrow += stride*2*3;
             r[2] = srcrow[0]<<Y_FIX;g[2] = srcrow[1]<<Y_FIX;b[2] = srcrow[2]<<Y_FIX;
             r[3] = srcrow[3]<<Y_FIX;g[3] = srcrow[4]<<Y_FIX;b[3] = srcrow[5]<<Y_FIX;
 
@@ -169,6 +177,10 @@ CP_API void CP_rgb2yuv_hq(CPYuvBlock *dst, const uint8_t* src, unsigned blockWid
     }
 }
 
+CP_API void CP_rgb2yuv_hq(CPYuvBlock *dst, const uint8_t* src, unsigned blockWidth, unsigned blockHeight) {
+    rgb2yuv_hq_strided(dst,src,blockWidth,blockHeight,blockWidth);
+}
+
 CP_API void CP_yuv_downscale_fast(CPYuvBlock *dst, const CPYuvBlock* src, unsigned blockWidth, unsigned blockHeight, unsigned extra_stride) {
     // Width/height relate to the destination
     // TODO: write HQ version
@@ -0,0 +1,107 @@
+#include "cinepunk_internal.hpp"
+
+// Identifies the worker (and pool) the current thread belongs to
+static thread_local CPThreadPool *current_pool = nullptr;
+static thread_local uint current_worker = 0;
+
+uint CPThreadPool::own_queue() {
+    return current_pool == this ? current_worker : workers.size();
+}
+
+void CPThreadPool::run(TaskGroup &group,std::function<void()> fun) {
+    if (workers.empty()) {
+        fun();
+        return;
+    }
+    group.pending++;
+    {
+        auto &queue = queues[own_queue()];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        queue.tasks.push_back({&group,std::move(fun)});
+    }
+    queued++;
+    // Lock to avoid lost wakeups
+    std::lock_guard<std::mutex> lock(sleep_lock);
+    sleep_cv.notify_one();
+}
+
+bool CPThreadPool::get_task(uint self,Task &task) {
+    if (queued == 0) return false;
+    uint queue_count = workers.size()+1;
+    // Own queue is LIFO, stealing is FIFO
+    {
+        auto &queue = queues[self];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    for (uint i=1;i<queue_count;i++) {
+        auto &queue = queues[(self+i)%queue_count];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CPThreadPool::run_task(Task &task) {
+    task.fun();
+    if (--task.group->pending == 0) {
+        std::lock_guard<std::mutex> lock(sleep_lock);
+        sleep_cv.notify_all();
+    }
+}
+
+void CPThreadPool::wait(TaskGroup &group) {
+    uint self = own_queue();
+    Task task;
+    while (group.pending > 0) {
+        // Help out instead of idling
+        if (get_task(self,task)) {
+            run_task(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_lock);
+        sleep_cv.wait(lock,[&](){return group.pending == 0 || queued > 0;});
+    }
+}
+
+void CPThreadPool::worker_loop(uint self) {
+    current_pool = this;
+    current_worker = self;
+    Task task;
+    for (;;) {
+        if (get_task(self,task)) {
+            run_task(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_lock);
+        sleep_cv.wait(lock,[&](){return quit || queued > 0;});
+        if (quit && queued == 0) return;
+    }
+}
+
+void CPThreadPool::set_workers(uint count) {
+    if (queues && count == workers.size()) return;
+    // Tear down old workers. Queues are drained before they exit.
+    {
+        std::lock_guard<std::mutex> lock(sleep_lock);
+        quit = true;
+    }
+    sleep_cv.notify_all();
+    for (auto &thread : workers) thread.join();
+    workers.clear();
+    quit = false;
+    queues = std::make_unique<WorkQueue[]>(count+1);
+    for (uint i=0;i<count;i++) {
+        workers.emplace_back([this,i](){worker_loop(i);});
+    }
+}
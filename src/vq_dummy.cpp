@@ -1,7 +1,7 @@
 #include "cinepunk_internal.hpp"
 
 // Dummy VQ algorithm. Just generates a codebook of grayscale blocks...
-u64 CPEncoderState::vq_dummy(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const CPYuvBlock *data,std::vector<uint> &applicable_indices,std::vector<u8> *closest_out) {
+u64 CPEncoderState::vq_dummy(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const TrainingSet &set,std::vector<u8> *closest_out) {
 
     assert(target_codebook_size>=2);
     codebook.clear();
@@ -12,11 +12,12 @@ u64 CPEncoderState::vq_dummy(std::vector<CPYuvBlock> &codebook,uint target_codeb
 
     u64 distortion = 0;
 
-    for(uint i:applicable_indices) {
-        u8 y = (data[i].ytl+data[i].ytr+data[i].ybl+data[i].ybr+2)>>2;
+    for(uint n=0;n<set.count;n++) {
+        u8 y = (set.ytl[n]+set.ytr[n]+set.ybl[n]+set.ybr[n]+2)>>2;
         u8 code = (y*(target_codebook_size-1)+128)/255;
-        if (closest_out) (*closest_out)[i] = code;
-        distortion += blockDistortion(data[i],codebook[code]);
+        if (closest_out) (*closest_out)[set.indices[n]] = code;
+        distortion += blockDistortion(set.block(n),codebook[code]);
     }
+    if (closest_out) set.expand_labels(*closest_out);
     return distortion;
 }
\ No newline at end of file
@@ -1,238 +1,878 @@
 #include "cinepunk_internal.hpp"
 #include <cstdio>
+#include <cmath>
 
-constexpr uint lbg_iterations = 2;
-constexpr uint split_iterations = 3;
-constexpr uint soca_iterations = 3;
-constexpr uint soca_search_len_lower = 256;
+// Iteration counts come from the encoder's CPEffort
 //constexpr uint soca_search_len_upper = 16;
 constexpr uint soca_sort_len = 32;
 
+// Work split granularity for the thread pool
+constexpr uint voronoi_chunk_size = 4096;
+constexpr uint centroid_chunk_size = 16;
 
+// Codebooks smaller than this are just searched exhaustively
+constexpr uint index_min_codebook_size = 32;
+// Integer scale that turns all component weights into integer divisors
+constexpr uint weight_scale = Y_WEIGHT*U_WEIGHT*V_WEIGHT;
 
+void CodebookIndex::build(const std::vector<CPYuvBlock> &codebook) {
+    // Find principal axis using power iteration on the covariance.
+    // Components are scaled by sqrt(weight) so that distortion is plain squared distance.
+    const float scale[6] = {sqrtf(U_WEIGHT),sqrtf(V_WEIGHT),sqrtf(Y_WEIGHT),sqrtf(Y_WEIGHT),sqrtf(Y_WEIGHT),sqrtf(Y_WEIGHT)};
+    auto component = [&](CPYuvBlock blk,uint k){return block_byte(blk,k+offsetof(CPYuvBlock,u))*scale[k];};
+    uint size = codebook.size();
+    float mean[6] = {};
+    for (auto code : codebook) {
+        for (uint k=0;k<6;k++) mean[k] += component(code,k);
+    }
+    for (uint k=0;k<6;k++) mean[k] /= size;
+    float cov[6][6] = {};
+    for (auto code : codebook) {
+        float d[6];
+        for (uint k=0;k<6;k++) d[k] = component(code,k)-mean[k];
+        for (uint i=0;i<6;i++) for (uint j=0;j<6;j++) cov[i][j] += d[i]*d[j];
+    }
+    float vec[6] = {0.25f,0.25f,1,1,1,1};
+    for (uint iter=0;iter<16;iter++) {
+        float next[6] = {};
+        float norm = 0;
+        for (uint i=0;i<6;i++) {
+            for (uint j=0;j<6;j++) next[i] += cov[i][j]*vec[j];
+            norm += next[i]*next[i];
+        }
+        if (!(norm > 0)) break;
+        norm = sqrtf(norm);
+        for (uint i=0;i<6;i++) vec[i] = next[i]/norm;
+    }
+    // Quantize back into unscaled integer axis.
+    // Any axis gives exact results, a good one just prunes more.
+    float max_component = 0;
+    for (uint k=0;k<6;k++) max_component = std::max(max_component,fabsf(vec[k]*scale[k]));
+    bool any_axis = false;
+    for (uint k=0;k<6;k++) {
+        axis[k] = max_component > 0 ? int(lroundf(vec[k]*scale[k]/max_component*64)) : 0;
+        any_axis |= axis[k] != 0;
+    }
+    if (!any_axis) axis = {0,0,1,1,1,1};
+    // Gray codebooks are only searched on luma, which the bound must then cover alone
+    mono = std::all_of(codebook.begin(),codebook.end(),isGray);
+    if (mono) axis[0] = axis[1] = 0;
+    // By Cauchy-Schwarz, gap^2 <= sum(axis^2/weight) * distortion
+    const uint weights[6] = {U_WEIGHT,V_WEIGHT,Y_WEIGHT,Y_WEIGHT,Y_WEIGHT,Y_WEIGHT};
+    axis_norm = 0;
+    for (uint k=0;k<6;k++) axis_norm += u64(axis[k]*axis[k])*(weight_scale/weights[k]);
+
+    order.resize(size);
+    std::iota(order.begin(),order.end(),0);
+    std::stable_sort(order.begin(),order.end(),[&](u8 i,u8 j){return project(codebook[i]) < project(codebook[j]);});
+    projection.resize(size);
+    codes.resize(size);
+    lane_ytop.resize(size);
+    lane_ybottom.resize(size);
+    lane_uv.resize(size);
+    for (uint i=0;i<size;i++) {
+        auto code = codes[i] = codebook[order[i]];
+        projection[i] = project(code);
+        lane_ytop[i]    = code.ytl | code.ytr<<16;
+        lane_ybottom[i] = code.ybl | code.ybr<<16;
+        lane_uv[i]      = code.u   | code.v  <<16;
+    }
+}
+
+template<bool SECOND,bool MONO>
+u8 CodebookIndex::search(CPYuvBlock vec,u32 &distortion,u32 *second_distortion,uint exclude_a,uint exclude_b,uint seed_code) const {
+    int p = project(vec);
+    int size = codes.size();
+    int upper = std::lower_bound(projection.begin(),projection.end(),p) - projection.begin();
+    int lower = upper-1;
+    // Chroma distortion is the same for every gray codeword, so add it back at the end
+    u32 chroma = MONO ? grayChromaDistortion(vec) : 0;
+    u32 lowest_distortion = seed_code < 256 ? distortion-chroma : UINT32_MAX;
+    u32 second_lowest = UINT32_MAX;
+    uint best_code = seed_code;
+    while (lower >= 0 || upper < size) {
+        // Walk outwards, nearest projection first
+        int k;
+        u64 gap;
+        if (upper >= size || (lower >= 0 && p-projection[lower] <= projection[upper]-p)) {
+            k = lower;
+            gap = p-projection[lower];
+        } else {
+            k = upper;
+            gap = projection[upper]-p;
+        }
+        if (gap*gap*weight_scale > axis_norm*(SECOND ? second_lowest : lowest_distortion)) {
+            // Everything further out on this side is too far, too
+            if (k == lower) lower = -1;
+            else upper = size;
+            continue;
+        }
+        if (k == lower) lower--;
+        else upper++;
+        uint code = order[k];
+        if (code == exclude_a || code == exclude_b) continue;
+        u32 dist = MONO ? lumaDistortion(vec,codes[k]) : blockDistortion(vec,codes[k]);
+        if (dist < lowest_distortion || (dist == lowest_distortion && code < best_code)) {
+            second_lowest = lowest_distortion;
+            lowest_distortion = dist;
+            best_code = code;
+        } else if (dist < second_lowest) {
+            second_lowest = dist;
+        }
+    }
+    distortion = u32(std::min<u64>(u64(lowest_distortion)+chroma,UINT32_MAX));
+    if (SECOND) *second_distortion = u32(std::min<u64>(u64(second_lowest)+chroma,UINT32_MAX));
+    return u8(best_code);
+}
+
+u8 CodebookIndex::nearest(CPYuvBlock vec,u32 &distortion,uint exclude_a,uint exclude_b) const {
+    if (mono) return search<false,true>(vec,distortion,nullptr,exclude_a,exclude_b,256);
+    return search<false,false>(vec,distortion,nullptr,exclude_a,exclude_b,256);
+}
+
+u8 CodebookIndex::nearest_seeded(CPYuvBlock vec,uint seed_code,u32 &distortion) const {
+    if (mono) return search<false,true>(vec,distortion,nullptr,256,256,seed_code);
+    return search<false,false>(vec,distortion,nullptr,256,256,seed_code);
+}
+
+u8 CodebookIndex::nearest2(CPYuvBlock vec,u32 &distortion,u32 &second_distortion) const {
+    if (mono) return search<true,true>(vec,distortion,&second_distortion,256,256,256);
+    return search<true,false>(vec,distortion,&second_distortion,256,256,256);
+}
+
+
+
+template<bool MONO>
 static u64 __attribute__((noinline)) voronoi_partition_generic(
-    const std::vector<CPYuvBlock> &codebook,const CPYuvBlock *data,std::vector<uint> &applicable_indices,
-    u64 *code_distortion, std::vector<std::vector<uint>> &partition
+    const std::vector<CPYuvBlock> &codebook,const TrainingSet &set,uint offset,uint count,
+    u64 *code_distortion, u8 *label
 ) {
         // Do Voronoi Partition
         // i.e. find closest codeword to each vector
         u64 total_distortion = 0;
-        for(uint i:applicable_indices) {
-            auto vec = data[i];
+        for(uint n=0;n<count;n++) {
+            auto vec = set.block(offset+n);
             u8 best_code = 0; // Doesn't actually need initial value
             u32 lowest_distortion = UINT32_MAX;
             for (uint j=0;j<codebook.size();j++) {
-                u32 distortion = blockDistortion(vec,codebook[j]);
+                u32 distortion = MONO ? lumaDistortion(vec,codebook[j]) : blockDistortion(vec,codebook[j]);
                 if (distortion<lowest_distortion) {
                     lowest_distortion = distortion;
                     best_code = j;
                 }
             }
+            if (MONO) lowest_distortion += grayChromaDistortion(vec);
             lowest_distortion *= vec.weight;
             code_distortion[best_code] += lowest_distortion;
             total_distortion += lowest_distortion;
-            partition[best_code].push_back(i);
+            label[n] = best_code;
         }
     return total_distortion;
 }
 
-static CPYuvBlock __attribute__((noinline)) calculate_centroid_generic(
-    const CPYuvBlock *data, const std::vector<uint> &partition
+#ifdef CINEPUNK_AVX2
+
+template<bool SECOND,bool MONO>
+u8 __attribute__((target("avx2"))) CodebookIndex::search_AVX2(CPYuvBlock vec,u32 &distortion,u32 *second_distortion,uint seed_code) const {
+    // Same as search(), but tests groups of 8 codewords at once.
+    // Groups are clamped to the codebook, lanes outside the current step are masked off.
+    assert(Y_WEIGHT == 1 && U_WEIGHT == 2 && V_WEIGHT == 2);
+    assert(codes.size() >= 8);
+    int p = project(vec);
+    int size = codes.size();
+    int upper = std::lower_bound(projection.begin(),projection.end(),p) - projection.begin();
+    int lower = upper-1;
+    __m256i vec_ytop    = _mm256_set1_epi32(vec.ytl | vec.ytr<<16);
+    __m256i vec_ybottom = _mm256_set1_epi32(vec.ybl | vec.ybr<<16);
+    __m256i vec_uv      = _mm256_set1_epi32(vec.u   | vec.v  <<16);
+    u32 chroma = MONO ? grayChromaDistortion(vec) : 0;
+    u32 lowest_distortion = seed_code < 256 ? distortion-chroma : INT32_MAX;
+    u32 second_lowest = INT32_MAX;
+    uint best_code = seed_code;
+    while (lower >= 0 || upper < size) {
+        int start;
+        u32 lanes;
+        u64 gap;
+        u64 threshold = SECOND ? second_lowest : lowest_distortion;
+        if (upper >= size || (lower >= 0 && p-projection[lower] <= projection[upper]-p)) {
+            gap = p-projection[lower];
+            if (gap*gap*weight_scale > axis_norm*threshold) {
+                lower = -1;
+                continue;
+            }
+            start = std::max(lower-7,0);
+            lanes = (2u<<(lower-start))-1;
+            lower -= 8;
+        } else {
+            gap = projection[upper]-p;
+            if (gap*gap*weight_scale > axis_norm*threshold) {
+                upper = size;
+                continue;
+            }
+            start = std::min(upper,size-8);
+            lanes = (0xFFu<<(upper-start))&0xFF;
+            upper += 8;
+        }
+        __m256i dytop    = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(lane_ytop.data()+start)),vec_ytop);
+        __m256i dybottom = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(lane_ybottom.data()+start)),vec_ybottom);
+        __m256i dist = _mm256_add_epi32(_mm256_madd_epi16(dytop,dytop),_mm256_madd_epi16(dybottom,dybottom));
+        if (!MONO) {
+            __m256i duv = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(lane_uv.data()+start)),vec_uv);
+            dist = _mm256_add_epi32(dist,_mm256_madd_epi16(duv,_mm256_add_epi16(duv,duv)));
+        }
+        // Look closer at anything that might beat or tie the current best
+        u32 candidates = lanes & ~_mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpgt_epi32(dist,_mm256_set1_epi32(threshold))));
+        if (candidates) {
+            alignas(32) u32 dist_out[8];
+            _mm256_store_si256((__m256i*)dist_out,dist);
+            for (;candidates;candidates &= candidates-1) {
+                uint lane = __builtin_ctz(candidates);
+                uint code = order[start+lane];
+                if (dist_out[lane] < lowest_distortion || (dist_out[lane] == lowest_distortion && code < best_code)) {
+                    second_lowest = lowest_distortion;
+                    lowest_distortion = dist_out[lane];
+                    best_code = code;
+                } else if (dist_out[lane] < second_lowest) {
+                    second_lowest = dist_out[lane];
+                }
+            }
+        }
+    }
+    distortion = lowest_distortion+chroma;
+    if (SECOND) *second_distortion = second_lowest+chroma;
+    return u8(best_code);
+}
+
+u8 CodebookIndex::nearest_AVX2(CPYuvBlock vec,u32 &distortion) const {
+    if (mono) return search_AVX2<false,true>(vec,distortion,nullptr,256);
+    return search_AVX2<false,false>(vec,distortion,nullptr,256);
+}
+
+u8 CodebookIndex::nearest2_AVX2(CPYuvBlock vec,u32 &distortion,u32 &second_distortion) const {
+    if (mono) return search_AVX2<true,true>(vec,distortion,&second_distortion,256);
+    return search_AVX2<true,false>(vec,distortion,&second_distortion,256);
+}
+
+u8 CodebookIndex::nearest_seeded_AVX2(CPYuvBlock vec,uint seed_code,u32 &distortion) const {
+    if (mono) return search_AVX2<false,true>(vec,distortion,nullptr,seed_code);
+    return search_AVX2<false,false>(vec,distortion,nullptr,seed_code);
+}
+
+static u64 __attribute__((noinline,target("avx2"))) voronoi_partition_indexed_AVX2(
+    const CodebookIndex &index,const TrainingSet &set,uint offset,uint count,
+    u64 *code_distortion, u8 *label
 ) {
-    // Find centroid of each codeword's partition and move it there
-    u32 ytl = 0,ytr = 0,ybl = 0,ybr = 0,u = 0,v = 0;
-    u32 total_weight = 0;
-    for (uint j:partition) {
-        auto block = data[j];
+        u64 total_distortion = 0;
+        for(uint n=0;n<count;n++) {
+            auto vec = set.block(offset+n);
+            u32 lowest_distortion;
+            u8 best_code = index.nearest_AVX2(vec,lowest_distortion);
+            lowest_distortion *= vec.weight;
+            code_distortion[best_code] += lowest_distortion;
+            total_distortion += lowest_distortion;
+            label[n] = best_code;
+        }
+    return total_distortion;
+}
+
+#endif
+
+static u64 __attribute__((noinline)) voronoi_partition_indexed(
+    const CodebookIndex &index,const TrainingSet &set,uint offset,uint count,
+    u64 *code_distortion, u8 *label
+) {
+        u64 total_distortion = 0;
+        for(uint n=0;n<count;n++) {
+            auto vec = set.block(offset+n);
+            u32 lowest_distortion;
+            u8 best_code = index.nearest(vec,lowest_distortion);
+            lowest_distortion *= vec.weight;
+            code_distortion[best_code] += lowest_distortion;
+            total_distortion += lowest_distortion;
+            label[n] = best_code;
+        }
+    return total_distortion;
+}
+
+// Weighted component sums of a run of training vectors
+struct CentroidSum {
+    u32 weight = 0,u = 0,v = 0,ytl = 0,ytr = 0,ybl = 0,ybr = 0;
+
+    inline void add(CPYuvBlock block) {
         ytl += block.ytl * block.weight;
         ytr += block.ytr * block.weight;
         ybl += block.ybl * block.weight;
         ybr += block.ybr * block.weight;
         u   += block.u   * block.weight;
         v   += block.v   * block.weight;
-        total_weight += block.weight;
-    }
-    assert(total_weight > 0);
-    return {
-        .u   = u8((u  +(total_weight>>1))/total_weight),
-        .v   = u8((v  +(total_weight>>1))/total_weight),
-        .ytl = u8((ytl+(total_weight>>1))/total_weight),
-        .ytr = u8((ytr+(total_weight>>1))/total_weight),
-        .ybl = u8((ybl+(total_weight>>1))/total_weight),
-        .ybr = u8((ybr+(total_weight>>1))/total_weight),
-    };
+        weight += block.weight;
+    }
+    inline void add_luma(CPYuvBlock block) {
+        ytl += block.ytl * block.weight;
+        ytr += block.ytr * block.weight;
+        ybl += block.ybl * block.weight;
+        ybr += block.ybr * block.weight;
+        weight += block.weight;
+    }
+    // Chroma sums of a run that is all gray, wrapping the same as adding it up
+    inline void set_gray_chroma() {
+        u = v = 128*weight;
+    }
+    inline void add(const CentroidSum &other) {
+        ytl += other.ytl;
+        ytr += other.ytr;
+        ybl += other.ybl;
+        ybr += other.ybr;
+        u   += other.u;
+        v   += other.v;
+        weight += other.weight;
+    }
+    inline CPYuvBlock centroid() const {
+        assert(weight > 0);
+        return {
+            .u   = u8((u  +(weight>>1))/weight),
+            .v   = u8((v  +(weight>>1))/weight),
+            .ytl = u8((ytl+(weight>>1))/weight),
+            .ytr = u8((ytr+(weight>>1))/weight),
+            .ybl = u8((ybl+(weight>>1))/weight),
+            .ybr = u8((ybr+(weight>>1))/weight),
+        };
+    }
+};
+
+template<bool MONO>
+static CentroidSum __attribute__((noinline)) centroid_sum_generic(
+    const TrainingSet &set, uint offset, uint count
+) {
+    CentroidSum sum;
+    if (MONO) {
+        for (uint n=offset;n<offset+count;n++) sum.add_luma(set.block(n));
+        sum.set_gray_chroma();
+    } else {
+        for (uint n=offset;n<offset+count;n++) sum.add(set.block(n));
+    }
+    return sum;
 }
 
 #ifdef CINEPUNK_AVX2
 
+// Zero-extend 8 lane bytes to dwords
+static inline __m256i __attribute__((always_inline,target("avx2"))) load_lane_AVX2(const u8 *lane) {
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(lane)));
+}
+static inline __m256i __attribute__((always_inline,target("avx2"))) load_weight_AVX2(const u16 *lane) {
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lane)));
+}
+
+template<bool MONO>
 static u64 __attribute__((noinline,target("avx2"))) voronoi_partition_AVX2(
-    const std::vector<CPYuvBlock> &codebook,const CPYuvBlock *data,std::vector<uint> &applicable_indices,
-    u64 *code_distortion, std::vector<std::vector<uint>> &partition
+    const std::vector<CPYuvBlock> &codebook,const TrainingSet &set,uint offset,uint count,
+    u64 *code_distortion, u8 *label
 ) {
-    __m256i weights = _mm256_set_epi32(Y_WEIGHT,Y_WEIGHT,Y_WEIGHT,Y_WEIGHT,V_WEIGHT,U_WEIGHT,0,0);
+    assert(Y_WEIGHT == 1 && U_WEIGHT == 2 && V_WEIGHT == 2);
     u64 total_distortion = 0;
-    //applicable_indices.reserve((applicable_indices.size()+7)&~7);
-    for (uint i=0;i<applicable_indices.size();i+=8) {
-        uint use = std::min(8u,uint(applicable_indices.size()-i));
-
-        // Minor hack: remove branches by accessing vector beyond nominal size
-        // (see reserve call above)
-        #if 0
-        __m256i pack10 = _mm256_cvtepu8_epi16(_mm_set_epi64x(
-            block_packed(data[applicable_indices[i+1]]),
-            block_packed(data[applicable_indices[i+0]])));
-        __m256i pack32 = _mm256_cvtepu8_epi16(_mm_set_epi64x(
-            block_packed(data[applicable_indices[i+3]]),
-            block_packed(data[applicable_indices[i+2]])));
-        __m256i pack54 = _mm256_cvtepu8_epi16(_mm_set_epi64x(
-            block_packed(data[applicable_indices[i+5]]),
-            block_packed(data[applicable_indices[i+4]])));
-        __m256i pack76 = _mm256_cvtepu8_epi16(_mm_set_epi64x(
-            block_packed(data[applicable_indices[i+7]]),
-            block_packed(data[applicable_indices[i+6]])));
-        #else
-        __m256i pack10 = _mm256_cvtepu8_epi16(_mm_set_epi64x(
-            use >  1 ? block_packed(data[applicable_indices[i+1]]) : 0,
-                       block_packed(data[applicable_indices[i+0]])    ));
-        __m256i pack32 = _mm256_cvtepu8_epi16(_mm_set_epi64x(
-            use >  3 ? block_packed(data[applicable_indices[i+3]]) : 0,
-            use >  2 ? block_packed(data[applicable_indices[i+2]]) : 0));
-        __m256i pack54 = _mm256_cvtepu8_epi16(_mm_set_epi64x(
-            use >  5 ? block_packed(data[applicable_indices[i+5]]) : 0,
-            use >  4 ? block_packed(data[applicable_indices[i+4]]) : 0));
-        __m256i pack76 = _mm256_cvtepu8_epi16(_mm_set_epi64x(
-            use >  7 ? block_packed(data[applicable_indices[i+7]]) : 0,
-            use >  6 ? block_packed(data[applicable_indices[i+6]]) : 0));
-        #endif
-
+    for (uint i=0;i<count;i+=8) {
+        uint n = offset+i;
+        uint use = std::min(8u,count-i);
+        // Component pairs in the 16 bit halves of each dword.
+        // Lanes past the end read padding and are never stored.
+        __m256i vec_ytop    = _mm256_or_si256(load_lane_AVX2(&set.ytl[n]),_mm256_slli_epi32(load_lane_AVX2(&set.ytr[n]),16));
+        __m256i vec_ybottom = _mm256_or_si256(load_lane_AVX2(&set.ybl[n]),_mm256_slli_epi32(load_lane_AVX2(&set.ybr[n]),16));
+        __m256i vec_uv      = _mm256_or_si256(load_lane_AVX2(&set.u[n]),  _mm256_slli_epi32(load_lane_AVX2(&set.v[n]),  16));
 
         __m256i lowest_distortion = _mm256_set1_epi32(INT32_MAX);
-        __m256i best_code = _mm256_set1_epi32(0);
-
+        __m256i best_code = _mm256_setzero_si256();
         for (uint j=0;j<codebook.size();j++) {
-            __m256i code_pack = _mm256_cvtepu8_epi16(_mm_set1_epi64x(block_packed(codebook[j])));
-            __m256i diff10 = _mm256_sub_epi16(code_pack,pack10);
-            __m256i diff32 = _mm256_sub_epi16(code_pack,pack32);
-            __m256i diff54 = _mm256_sub_epi16(code_pack,pack54);
-            __m256i diff76 = _mm256_sub_epi16(code_pack,pack76);
-            diff10 = _mm256_mullo_epi16(diff10,diff10);
-            diff32 = _mm256_mullo_epi16(diff32,diff32);
-            diff54 = _mm256_mullo_epi16(diff54,diff54);
-            diff76 = _mm256_mullo_epi16(diff76,diff76);
-
-            #if 1
-            assert(Y_WEIGHT == 1 && U_WEIGHT == 2 && V_WEIGHT == 2);
-            // Duplicate UV into unused slots
-            diff10 = _mm256_shuffle_epi32(diff10,0b11'10'01'01);
-            diff32 = _mm256_shuffle_epi32(diff32,0b11'10'01'01);
-            diff54 = _mm256_shuffle_epi32(diff54,0b11'10'01'01);
-            diff76 = _mm256_shuffle_epi32(diff76,0b11'10'01'01);
-            __m256i diff0 = _mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff10,0));
-            __m256i diff1 = _mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff10,1));
-            __m256i diff2 = _mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff32,0));
-            __m256i diff3 = _mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff32,1));
-            __m256i diff4 = _mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff54,0));
-            __m256i diff5 = _mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff54,1));
-            __m256i diff6 = _mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff76,0));
-            __m256i diff7 = _mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff76,1));
-            #else
-            __m256i diff0 = _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff10,0)),weights);
-            __m256i diff1 = _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff10,1)),weights);
-            __m256i diff2 = _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff32,0)),weights);
-            __m256i diff3 = _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff32,1)),weights);
-            __m256i diff4 = _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff54,0)),weights);
-            __m256i diff5 = _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff54,1)),weights);
-            __m256i diff6 = _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff76,0)),weights);
-            __m256i diff7 = _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extractf128_si256(diff76,1)),weights);
-            #endif
-
-            __m256i sum10 = _mm256_hadd_epi32(diff0,diff1);
-            __m256i sum32 = _mm256_hadd_epi32(diff2,diff3);
-            __m256i sum54 = _mm256_hadd_epi32(diff4,diff5);
-            __m256i sum76 = _mm256_hadd_epi32(diff6,diff7);
-            // {0a+0b,0c+0d,1a+1b,1c+1d , 0e+0f,0g+0h,1e+1f,1g+1h}
-            __m256i sum3210 = _mm256_hadd_epi32(sum10,sum32);
-            __m256i sum7654 = _mm256_hadd_epi32(sum54,sum76);
-            // {0a+0b+0c+0d,1a+1b+1c+1d,2a+2b+2c+2d,3a+3b+3c+3d , 0e+0f+0g+0h,1e+1f+1g+1h,2e+2f+2g+2h,3e+3f+3g+3h}
-            __m128i sumlow = _mm_add_epi32(_mm256_extractf128_si256(sum3210,1),_mm256_extractf128_si256(sum3210,0));
-            __m128i sumhi = _mm_add_epi32(_mm256_extractf128_si256(sum7654,1),_mm256_extractf128_si256(sum7654,0));
-            __m256i distortion = _mm256_set_m128i(sumhi,sumlow);
-
+            auto code = codebook[j];
+            __m256i dytop    = _mm256_sub_epi16(vec_ytop,   _mm256_set1_epi32(code.ytl | code.ytr<<16));
+            __m256i dybottom = _mm256_sub_epi16(vec_ybottom,_mm256_set1_epi32(code.ybl | code.ybr<<16));
+            __m256i distortion = _mm256_add_epi32(_mm256_madd_epi16(dytop,dytop),_mm256_madd_epi16(dybottom,dybottom));
+            if (!MONO) {
+                __m256i duv = _mm256_sub_epi16(vec_uv,_mm256_set1_epi32(code.u | code.v<<16));
+                distortion = _mm256_add_epi32(distortion,_mm256_madd_epi16(duv,_mm256_add_epi16(duv,duv)));
+            }
+            // Strictly less, so the lowest index wins ties
             __m256i better_mask = _mm256_cmpgt_epi32(lowest_distortion,distortion);
             lowest_distortion = _mm256_blendv_epi8(lowest_distortion,distortion,better_mask);
             best_code = _mm256_blendv_epi8(best_code,_mm256_set1_epi32(j),better_mask);
         }
+        if (MONO) {
+            // Chroma distortion against gray is the same for every codeword
+            __m256i duv = _mm256_sub_epi16(vec_uv,_mm256_set1_epi32(128 | 128<<16));
+            lowest_distortion = _mm256_add_epi32(lowest_distortion,_mm256_madd_epi16(duv,_mm256_add_epi16(duv,duv)));
+        }
+        lowest_distortion = _mm256_mullo_epi32(lowest_distortion,load_weight_AVX2(&set.weight[n]));
 
-        #pragma GCC unroll 8 // Need to unroll, otherwise extract intrinsic gets busted
+        alignas(32) u32 distortion_out[8],code_out[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(distortion_out),lowest_distortion);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(code_out),best_code);
         for (uint sub=0;sub<use;sub++) {
-            u32 code = _mm256_extract_epi32(best_code,sub);
-            auto index = applicable_indices[i+sub];
-            auto distortion = _mm256_extract_epi32(lowest_distortion,sub) *
-                _mm256_extract_epi16((sub&4) ? ((sub&2) ? pack76 : pack54) : ((sub&2) ? pack32 : pack10) ,(sub&1)*8);
-            code_distortion[code] += distortion;
-            total_distortion += distortion;
-            partition[code].push_back(index);
+            code_distortion[code_out[sub]] += distortion_out[sub];
+            total_distortion += distortion_out[sub];
+            label[i+sub] = code_out[sub];
         }
     }
     return total_distortion;
 }
 
-static CPYuvBlock __attribute__((noinline,target("avx2"))) calculate_centroid_AVX2(
-    const CPYuvBlock *data, const std::vector<uint> &partition
+template<bool MONO>
+static CentroidSum __attribute__((noinline,target("avx2"))) centroid_sum_AVX2(
+    const TrainingSet &set, uint offset, uint count
 ) {
-    // Find centroid of each codeword's partition and move it there
-    __m256i total = _mm256_set1_epi32(0);
-    for (uint j:partition) {
-        auto block = _mm256_cvtepu8_epi32(_mm_set_epi64x(0,block_packed(data[j])));
-        auto weight = _mm256_broadcastd_epi32(_mm256_extractf128_si256(block,0));
-        block = _mm256_insert_epi32(block,1,0);
-        total = _mm256_add_epi32(total,_mm256_mullo_epi32(block,weight));
-    }
-    int32_t total_weight = _mm256_extract_epi32(total,0);
-    assert(total_weight > 0);
-    total = _mm256_add_epi32(total,_mm256_srai_epi32(_mm256_broadcastd_epi32(_mm256_extractf128_si256(total,0)),1));
-    return {
-        .u   = u8(_mm256_extract_epi32(total,2)/total_weight),
-        .v   = u8(_mm256_extract_epi32(total,3)/total_weight),
-        .ytl = u8(_mm256_extract_epi32(total,4)/total_weight),
-        .ytr = u8(_mm256_extract_epi32(total,5)/total_weight),
-        .ybl = u8(_mm256_extract_epi32(total,6)/total_weight),
-        .ybr = u8(_mm256_extract_epi32(total,7)/total_weight),
-    };
+    __m256i u = _mm256_setzero_si256(),v = u,ytl = u,ytr = u,ybl = u,ybr = u,total_weight = u;
+    for (uint i=0;i<count;i+=8) {
+        uint n = offset+i;
+        // Lanes past the end of the run get zero weight
+        __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(count-i),_mm256_setr_epi32(0,1,2,3,4,5,6,7));
+        __m256i weight = _mm256_and_si256(valid,load_weight_AVX2(&set.weight[n]));
+        total_weight = _mm256_add_epi32(total_weight,weight);
+        if (!MONO) {
+            u = _mm256_add_epi32(u,_mm256_mullo_epi32(load_lane_AVX2(&set.u[n]),weight));
+            v = _mm256_add_epi32(v,_mm256_mullo_epi32(load_lane_AVX2(&set.v[n]),weight));
+        }
+        ytl = _mm256_add_epi32(ytl,_mm256_mullo_epi32(load_lane_AVX2(&set.ytl[n]),weight));
+        ytr = _mm256_add_epi32(ytr,_mm256_mullo_epi32(load_lane_AVX2(&set.ytr[n]),weight));
+        ybl = _mm256_add_epi32(ybl,_mm256_mullo_epi32(load_lane_AVX2(&set.ybl[n]),weight));
+        ybr = _mm256_add_epi32(ybr,_mm256_mullo_epi32(load_lane_AVX2(&set.ybr[n]),weight));
+    }
+    alignas(32) u32 lanes[7][8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[0]),total_weight);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[1]),u);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[2]),v);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[3]),ytl);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[4]),ytr);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[5]),ybl);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[6]),ybr);
+    CentroidSum sum;
+    sum.weight = std::accumulate(lanes[0],lanes[0]+8,u32(0));
+    sum.u      = std::accumulate(lanes[1],lanes[1]+8,u32(0));
+    sum.v      = std::accumulate(lanes[2],lanes[2]+8,u32(0));
+    sum.ytl    = std::accumulate(lanes[3],lanes[3]+8,u32(0));
+    sum.ytr    = std::accumulate(lanes[4],lanes[4]+8,u32(0));
+    sum.ybl    = std::accumulate(lanes[5],lanes[5]+8,u32(0));
+    sum.ybr    = std::accumulate(lanes[6],lanes[6]+8,u32(0));
+    if (MONO) sum.set_gray_chroma();
+    return sum;
+}
+
+// The unmasked forms of these intrinsics pass an undefined vector through,
+// which GCC reports as uninitialized under -Wall. All lanes are selected either way.
+constexpr __mmask16 all_lanes = 0xFFFF;
+
+// Zero-extend 16 lane bytes to dwords
+static inline __m512i __attribute__((always_inline,target("avx512f,avx512bw"))) load_lane_AVX512(const u8 *lane) {
+    return _mm512_maskz_cvtepu8_epi32(all_lanes,_mm_loadu_si128(reinterpret_cast<const __m128i*>(lane)));
+}
+static inline __m512i __attribute__((always_inline,target("avx512f,avx512bw"))) load_weight_AVX512(const u16 *lane) {
+    return _mm512_maskz_cvtepu16_epi32(all_lanes,_mm256_loadu_si256(reinterpret_cast<const __m256i*>(lane)));
+}
+// Low lane byte, next lane byte in the upper word
+static inline __m512i __attribute__((always_inline,target("avx512f,avx512bw"))) load_pair_AVX512(const u8 *low,const u8 *high) {
+    return _mm512_or_si512(load_lane_AVX512(low),_mm512_maskz_slli_epi32(all_lanes,load_lane_AVX512(high),16));
+}
+// Horizontal sum through the 256-bit halves
+static inline u32 __attribute__((always_inline,target("avx512f,avx512bw"))) reduce_add_AVX512(__m512i x) {
+    __m256i half = _mm256_add_epi32(_mm512_maskz_extracti64x4_epi64(0xF,x,0),_mm512_maskz_extracti64x4_epi64(0xF,x,1));
+    alignas(32) u32 lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes),half);
+    return std::accumulate(lanes,lanes+8,u32(0));
+}
+
+template<bool MONO>
+static u64 __attribute__((noinline,target("avx512f,avx512bw"))) voronoi_partition_AVX512(
+    const std::vector<CPYuvBlock> &codebook,const TrainingSet &set,uint offset,uint count,
+    u64 *code_distortion, u8 *label
+) {
+    assert(Y_WEIGHT == 1 && U_WEIGHT == 2 && V_WEIGHT == 2);
+    u64 total_distortion = 0;
+    for (uint i=0;i<count;i+=16) {
+        uint n = offset+i;
+        uint use = std::min(16u,count-i);
+        __m512i vec_ytop    = load_pair_AVX512(&set.ytl[n],&set.ytr[n]);
+        __m512i vec_ybottom = load_pair_AVX512(&set.ybl[n],&set.ybr[n]);
+        __m512i vec_uv      = load_pair_AVX512(&set.u[n],&set.v[n]);
+
+        __m512i lowest_distortion = _mm512_set1_epi32(UINT32_MAX);
+        __m512i best_code = _mm512_setzero_si512();
+        for (uint j=0;j<codebook.size();j++) {
+            auto code = codebook[j];
+            __m512i dytop    = _mm512_sub_epi16(vec_ytop,   _mm512_set1_epi32(code.ytl | code.ytr<<16));
+            __m512i dybottom = _mm512_sub_epi16(vec_ybottom,_mm512_set1_epi32(code.ybl | code.ybr<<16));
+            __m512i distortion = _mm512_add_epi32(_mm512_madd_epi16(dytop,dytop),_mm512_madd_epi16(dybottom,dybottom));
+            if (!MONO) {
+                __m512i duv = _mm512_sub_epi16(vec_uv,_mm512_set1_epi32(code.u | code.v<<16));
+                distortion = _mm512_add_epi32(distortion,_mm512_madd_epi16(duv,_mm512_add_epi16(duv,duv)));
+            }
+            // Strictly less, so the lowest index wins ties
+            __mmask16 better = _mm512_cmplt_epu32_mask(distortion,lowest_distortion);
+            lowest_distortion = _mm512_mask_mov_epi32(lowest_distortion,better,distortion);
+            best_code = _mm512_mask_mov_epi32(best_code,better,_mm512_set1_epi32(j));
+        }
+        if (MONO) {
+            __m512i duv = _mm512_sub_epi16(vec_uv,_mm512_set1_epi32(128 | 128<<16));
+            lowest_distortion = _mm512_add_epi32(lowest_distortion,_mm512_madd_epi16(duv,_mm512_add_epi16(duv,duv)));
+        }
+        lowest_distortion = _mm512_mullo_epi32(lowest_distortion,load_weight_AVX512(&set.weight[n]));
+
+        alignas(64) u32 distortion_out[16],code_out[16];
+        _mm512_store_si512(distortion_out,lowest_distortion);
+        _mm512_store_si512(code_out,best_code);
+        for (uint sub=0;sub<use;sub++) {
+            code_distortion[code_out[sub]] += distortion_out[sub];
+            total_distortion += distortion_out[sub];
+            label[i+sub] = code_out[sub];
+        }
+    }
+    return total_distortion;
+}
+
+template<bool MONO>
+static CentroidSum __attribute__((noinline,target("avx512f,avx512bw"))) centroid_sum_AVX512(
+    const TrainingSet &set, uint offset, uint count
+) {
+    __m512i u = _mm512_setzero_si512(),v = u,ytl = u,ytr = u,ybl = u,ybr = u,total_weight = u;
+    for (uint i=0;i<count;i+=16) {
+        uint n = offset+i;
+        // Lanes past the end of the run get zero weight
+        __mmask16 valid = (1u<<std::min(16u,count-i))-1;
+        __m512i weight = _mm512_maskz_mov_epi32(valid,load_weight_AVX512(&set.weight[n]));
+        total_weight = _mm512_add_epi32(total_weight,weight);
+        if (!MONO) {
+            u = _mm512_add_epi32(u,_mm512_mullo_epi32(load_lane_AVX512(&set.u[n]),weight));
+            v = _mm512_add_epi32(v,_mm512_mullo_epi32(load_lane_AVX512(&set.v[n]),weight));
+        }
+        ytl = _mm512_add_epi32(ytl,_mm512_mullo_epi32(load_lane_AVX512(&set.ytl[n]),weight));
+        ytr = _mm512_add_epi32(ytr,_mm512_mullo_epi32(load_lane_AVX512(&set.ytr[n]),weight));
+        ybl = _mm512_add_epi32(ybl,_mm512_mullo_epi32(load_lane_AVX512(&set.ybl[n]),weight));
+        ybr = _mm512_add_epi32(ybr,_mm512_mullo_epi32(load_lane_AVX512(&set.ybr[n]),weight));
+    }
+    // Sums wrap around the same way as the u32 sums in generic
+    CentroidSum sum;
+    sum.weight = reduce_add_AVX512(total_weight);
+    sum.u      = reduce_add_AVX512(u);
+    sum.v      = reduce_add_AVX512(v);
+    sum.ytl    = reduce_add_AVX512(ytl);
+    sum.ytr    = reduce_add_AVX512(ytr);
+    sum.ybl    = reduce_add_AVX512(ybl);
+    sum.ybr    = reduce_add_AVX512(ybr);
+    if (MONO) sum.set_gray_chroma();
+    return sum;
 }
 
 #endif
 
 
-u64 voronoi_partition(const std::vector<CPYuvBlock> &codebook,const CPYuvBlock *data,std::vector<uint> &applicable_indices,
-    u64 *code_distortion, std::vector<std::vector<uint>> &partition
+static u64 voronoi_partition_range(const std::vector<CPYuvBlock> &codebook,bool mono,const CodebookIndex *index,const TrainingSet &set,uint offset,uint count,
+    u64 *code_distortion, u8 *label
 ) {
+    if (index) {
+        #ifdef CINEPUNK_AVX2
+        if(__builtin_cpu_supports("avx2")) {
+            return voronoi_partition_indexed_AVX2(*index,set,offset,count,code_distortion,label);
+        }
+        #endif
+        return voronoi_partition_indexed(*index,set,offset,count,code_distortion,label);
+    }
     #ifdef CINEPUNK_AVX2
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        if (mono) return voronoi_partition_AVX512<true>(codebook,set,offset,count,code_distortion,label);
+        return voronoi_partition_AVX512<false>(codebook,set,offset,count,code_distortion,label);
+    }
     if(__builtin_cpu_supports("avx2")) {
-        return voronoi_partition_AVX2(codebook,data,applicable_indices,code_distortion,partition);
+        if (mono) return voronoi_partition_AVX2<true>(codebook,set,offset,count,code_distortion,label);
+        return voronoi_partition_AVX2<false>(codebook,set,offset,count,code_distortion,label);
+    }
+    #endif
+    if (mono) return voronoi_partition_generic<true>(codebook,set,offset,count,code_distortion,label);
+    return voronoi_partition_generic<false>(codebook,set,offset,count,code_distortion,label);
+}
+
+template<typename F>
+static u64 partition_chunked(uint count,uint codebook_size,u64 *code_distortion, CPThreadPool *pool, F kernel) {
+    if (!pool || pool->worker_count() == 0 || count <= voronoi_chunk_size) {
+        return kernel(0,count,code_distortion);
+    }
+    // Chunks label disjoint ranges, so only the distortion sums need merging.
+    uint chunks = (count+voronoi_chunk_size-1)/voronoi_chunk_size;
+    std::vector<std::array<u64,256>> chunk_distortion(chunks);
+    std::vector<u64> chunk_total(chunks);
+    pool->parallel_for(0,chunks,1,[&](uint begin,uint end){
+        for (uint c=begin;c<end;c++) {
+            uint offset = c*voronoi_chunk_size;
+            chunk_distortion[c].fill(0);
+            chunk_total[c] = kernel(offset,std::min(voronoi_chunk_size,count-offset),chunk_distortion[c].data());
+        }
+    });
+    u64 total_distortion = 0;
+    for (uint c=0;c<chunks;c++) {
+        total_distortion += chunk_total[c];
+        for (uint j=0;j<codebook_size;j++) code_distortion[j] += chunk_distortion[c][j];
+    }
+    return total_distortion;
+}
+
+u64 voronoi_partition(const std::vector<CPYuvBlock> &codebook,const TrainingSet &set,uint offset,uint count,
+    u64 *code_distortion, u8 *label, CPThreadPool *pool, const CodebookIndex *index
+) {
+    CodebookIndex local_index;
+    if (!index && codebook.size() >= index_min_codebook_size) {
+        local_index.build(codebook);
+        index = &local_index;
+    }
+    bool mono = std::all_of(codebook.begin(),codebook.end(),isGray);
+    return partition_chunked(count,codebook.size(),code_distortion,pool,
+        [&](uint chunk_offset,uint chunk_count,u64 *chunk_distortion){
+            return voronoi_partition_range(codebook,mono,index,set,offset+chunk_offset,chunk_count,chunk_distortion,label+chunk_offset);
+        });
+}
+
+void TrainingSet::resize(uint size) {
+    count = size;
+    uint padded = size+training_set_padding;
+    ytl.resize(padded);
+    ytr.resize(padded);
+    ybl.resize(padded);
+    ybr.resize(padded);
+    u.resize(padded);
+    v.resize(padded);
+    weight.resize(padded);
+}
+
+// Components of a block without its weight, as one integer
+static inline u64 block_key(CPYuvBlock blk) {
+    u64 raw;
+    static_assert(sizeof(blk) == sizeof(raw));
+    memcpy(&raw,&blk,sizeof(raw));
+    return raw >> 16;
+}
+
+void TrainingSet::gather(const CPYuvBlock *data,const std::vector<uint> &applicable_indices) {
+    // Flat areas, letterboxing and screen content repeat the same blocks a lot.
+    // Hashing folds every repeat into the first copy, so training only sees distinct blocks.
+    uint size = applicable_indices.size();
+    resize(size);
+    source_count = size;
+    indices.clear();
+    duplicates.clear();
+    uint table_bits = 4;
+    while ((1u<<table_bits) < size*2) table_bits++;
+    uint table_mask = (1u<<table_bits)-1;
+    slots.assign(table_mask+1,UINT32_MAX);
+    uint n = 0;
+    mono = true;
+    for (uint index : applicable_indices) {
+        auto blk = data[index];
+        u64 key = block_key(blk);
+        uint slot = (key*0x9E3779B97F4A7C15) >> (64-table_bits);
+        for (;;slot = (slot+1)&table_mask) {
+            uint other = slots[slot];
+            if (other != UINT32_MAX && block_key(block(other)) != key) continue;
+            if (other != UINT32_MAX && weight[other]+blk.weight <= coalesce_weight_limit) {
+                weight[other] += blk.weight;
+                duplicates.push_back({index,other});
+            } else {
+                // New block, or the old one is full and this takes its place
+                slots[slot] = n;
+                indices.push_back(index);
+                set_block(n++,blk);
+                mono &= isGray(blk);
+            }
+            break;
+        }
+    }
+    resize(n);
+}
+
+// Gives folded blocks the label of the vector they were folded into
+void TrainingSet::expand_labels(std::vector<u8> &closest) const {
+    for (auto [index,n] : duplicates) closest[index] = closest[indices[n]];
+}
+
+void VoronoiPartition::group(const TrainingSet &set) {
+    // Counting sort, stable so each bucket stays in training set order
+    uint fill[256] = {};
+    for (uint n=0;n<set.count;n++) fill[label[n]]++;
+    uint sum = 0;
+    for (uint j=0;j<256;j++) {
+        bucket_start[j] = sum;
+        sum += fill[j];
+        bucket_end[j] = sum;
+        fill[j] = bucket_start[j];
+    }
+    // Twice the size, so shifts have room to move buckets to
+    grouped.resize(set.count*2);
+    grouped.mono = set.mono;
+    members.resize(set.count*2);
+    grouped_end = set.count;
+    for (uint n=0;n<set.count;n++) {
+        uint pos = fill[label[n]]++;
+        grouped.set_block(pos,set.block(n));
+        members[pos] = n;
+    }
+}
+
+// Follows a SoCA shift whose labels are already written.
+// The from and replace buckets become the new replace bucket,
+// the to bucket splits into from and to as shift_label says.
+// Moved vectors go to the unused room, so only the three buckets are copied.
+void VoronoiPartition::shift(const TrainingSet &set,uint from,uint replace,uint to) {
+    uint from_begin = bucket_start[from],from_size = bucket_size(from);
+    uint replace_begin = bucket_start[replace],replace_size = bucket_size(replace);
+    uint to_begin = bucket_start[to],to_size = bucket_size(to);
+    if (grouped_end + from_size + replace_size + to_size > grouped.count) {
+        // Out of room, so sort everything again, which also reclaims the gaps
+        group(set);
+        return;
     }
+    auto move = [&](uint n,uint pos){
+        grouped.set_block(pos,grouped.block(n));
+        members[pos] = members[n];
+    };
+    bucket_start[replace] = grouped_end;
+    for (uint n=from_begin;n<from_begin+from_size;n++) move(n,grouped_end++);
+    for (uint n=replace_begin;n<replace_begin+replace_size;n++) move(n,grouped_end++);
+    bucket_end[replace] = grouped_end;
+    // Vectors staying with to move out, the ones going to from close up in place
+    bucket_start[to] = grouped_end;
+    uint kept = to_begin;
+    for (uint k=0;k<to_size;k++) {
+        if (shift_label[k]) move(to_begin+k,grouped_end++);
+        else move(to_begin+k,kept++);
+    }
+    bucket_end[to] = grouped_end;
+    bucket_start[from] = to_begin;
+    bucket_end[from] = kept;
+}
+
+// Hamerly's bounds, carried between passes over the same training set.
+// Distances are sqrt(distortion), so the triangle inequality holds.
+struct PartitionBounds {
+    std::vector<CPYuvBlock> codebook; // As of the last pass
+    std::vector<u8> nearest; // Per training vector
+    std::vector<float> lower; // Lower bound on distance to every other codeword
+};
+
+// Conservative slack, well above the float rounding error of sqrt.
+// It only ever loosens the bounds, so at worst a few more vectors get searched.
+constexpr float bound_epsilon = 1.0f/64;
+
+static u64 __attribute__((noinline)) voronoi_partition_bounded_range(
+    const std::vector<CPYuvBlock> &codebook,const CodebookIndex &index,const TrainingSet &set,uint offset,uint count,
+    u8 *nearest,float *lower,const float *half_gap,const float *drift,bool reset,
+    u64 *code_distortion, u8 *label
+) {
+    #ifdef CINEPUNK_AVX2
+    bool avx2 = __builtin_cpu_supports("avx2");
     #endif
-    return voronoi_partition_generic(codebook,data,applicable_indices,code_distortion,partition);
+    u64 total_distortion = 0;
+    for(uint n=0;n<count;n++) {
+        auto vec = set.block(offset+n);
+        u32 lowest_distortion;
+        u8 best_code;
+        if (reset) {
+            u32 second_distortion;
+            #ifdef CINEPUNK_AVX2
+            if (avx2) best_code = index.nearest2_AVX2(vec,lowest_distortion,second_distortion);
+            else
+            #endif
+            best_code = index.nearest2(vec,lowest_distortion,second_distortion);
+            nearest[n] = best_code;
+            lower[n] = sqrtf(second_distortion);
+        } else {
+            // Previous codeword is still strictly nearest if it's closer than
+            // half its distance to any other codeword or than the lower bound.
+            best_code = nearest[n];
+            lowest_distortion = blockDistortion(vec,codebook[best_code]);
+            lower[n] -= drift[best_code];
+            if (!(sqrtf(lowest_distortion) + bound_epsilon < std::max(half_gap[best_code],lower[n]))) {
+                // Starting from the previous codeword prunes better than a full
+                // second-nearest search, at the cost of losing the lower bound.
+                #ifdef CINEPUNK_AVX2
+                if (avx2) best_code = index.nearest_seeded_AVX2(vec,best_code,lowest_distortion);
+                else
+                #endif
+                best_code = index.nearest_seeded(vec,best_code,lowest_distortion);
+                nearest[n] = best_code;
+                lower[n] = 0;
+            }
+        }
+        lowest_distortion *= vec.weight;
+        code_distortion[best_code] += lowest_distortion;
+        total_distortion += lowest_distortion;
+        label[n] = best_code;
+    }
+    return total_distortion;
 }
 
-static CPYuvBlock __attribute__((noinline)) calculate_centroid(
-    const CPYuvBlock *data, const std::vector<uint> &partition
+// Same result as voronoi_partition, but skips the search for vectors
+// whose nearest codeword provably didn't change since the last pass.
+static u64 voronoi_partition_bounded(const std::vector<CPYuvBlock> &codebook,const CodebookIndex &index,const TrainingSet &set,
+    u64 *code_distortion, u8 *label, PartitionBounds &bounds, CPThreadPool *pool
+) {
+    uint size = codebook.size();
+    bool reset = bounds.codebook.size() != size;
+    float half_gap[256],drift[256];
+    if (reset) {
+        bounds.nearest.resize(set.count);
+        bounds.lower.resize(set.count);
+    } else {
+        // Every bound loosens by how far the other codewords moved
+        float max_move = 0,second_move = 0;
+        uint max_code = 0;
+        for (uint j=0;j<size;j++) {
+            float move = sqrtf(blockDistortion(codebook[j],bounds.codebook[j]));
+            if (move > max_move) {
+                second_move = max_move;
+                max_move = move;
+                max_code = j;
+            } else second_move = std::max(second_move,move);
+        }
+        for (uint j=0;j<size;j++) {
+            drift[j] = (j == max_code ? second_move : max_move) + bound_epsilon;
+            u32 gap;
+            index.nearest(codebook[j],gap,j);
+            half_gap[j] = sqrtf(gap)*0.5f;
+        }
+    }
+    bounds.codebook = codebook;
+    return partition_chunked(set.count,size,code_distortion,pool,
+        [&](uint offset,uint count,u64 *chunk_distortion){
+            return voronoi_partition_bounded_range(codebook,index,set,offset,count,
+                bounds.nearest.data()+offset,bounds.lower.data()+offset,half_gap,drift,reset,chunk_distortion,label+offset);
+        });
+}
+
+static CentroidSum centroid_sum(
+    const TrainingSet &set, uint offset, uint count
 ) {
     #ifdef CINEPUNK_AVX2
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        if (set.mono) return centroid_sum_AVX512<true>(set,offset,count);
+        return centroid_sum_AVX512<false>(set,offset,count);
+    }
     if(__builtin_cpu_supports("avx2")) {
-        return calculate_centroid_AVX2(data,partition);
+        if (set.mono) return centroid_sum_AVX2<true>(set,offset,count);
+        return centroid_sum_AVX2<false>(set,offset,count);
     }
     #endif
-    return calculate_centroid_generic(data,partition);
+    if (set.mono) return centroid_sum_generic<true>(set,offset,count);
+    return centroid_sum_generic<false>(set,offset,count);
+}
+
+static CPYuvBlock calculate_centroid(
+    const TrainingSet &set, uint offset, uint count
+) {
+    return centroid_sum(set,offset,count).centroid();
 }
 
-static std::array<CPYuvBlock,2>  __attribute__((noinline)) bbox_distrib(const CPYuvBlock *data, const std::vector<uint> &indices) {
+static std::array<CPYuvBlock,2>  __attribute__((noinline)) bbox_distrib(const TrainingSet &set, uint offset, uint count) {
     // Calculate new codes for SoCAs using bounding box method
     // TODO: since this runs on high-utility codes, maybe make AVX version?
     u8 ytlmin=255,ytrmin=255,yblmin=255,ybrmin=255,umin=255,vmin=255;
     u8 ytlmax=  0,ytrmax=  0,yblmax=  0,ybrmax=  0,umax=  0,vmax=  0;
-    for (uint idx : indices) {
-        auto block = data[idx];
+    for (uint n=offset;n<offset+count;n++) {
+        auto block = set.block(n);
         ytlmin = std::min(ytlmin,block.ytl);
         ytlmax = std::max(ytlmax,block.ytl);
         ytrmin = std::min(ytrmin,block.ytr);
@@ -273,7 +913,7 @@ static std::array<CPYuvBlock,2>  __attribute__((noinline)) bbox_distrib(const CP
     return {new1,new2};
 }
 
-static bool  __attribute__((noinline)) try_shift(std::vector<CPYuvBlock> &codebook, const CPYuvBlock *data, uint from, uint to, u64 *code_distortion, std::vector<std::vector<uint>> &partition) {
+static bool  __attribute__((noinline)) try_shift(std::vector<CPYuvBlock> &codebook, const CodebookIndex *index, const TrainingSet &set, uint from, uint to, u64 *code_distortion, VoronoiPartition &partition, uint soca_iterations) {
 
     //fprintf(stderr,"try_shift\n");
     if (code_distortion[from] > code_distortion[to]) return false;
@@ -285,7 +925,9 @@ static bool  __attribute__((noinline)) try_shift(std::vector<CPYuvBlock> &codebo
     // Find codeword to replace from with
     uint replace = 0;
     u32 nearest_distortion = UINT32_MAX;
-    for (uint i=0;i<codebook.size();i++) {
+    if (index) {
+        replace = index->nearest(codebook[from],nearest_distortion,from,to);
+    } else for (uint i=0;i<codebook.size();i++) {
         if (i==from || i == to) continue;
         u32 distortion = blockDistortion(codebook[from],codebook[i]);
         if (distortion < nearest_distortion) {
@@ -293,76 +935,95 @@ static bool  __attribute__((noinline)) try_shift(std::vector<CPYuvBlock> &codebo
             nearest_distortion = distortion;
         }
     }
-    std::vector<uint> replace_partition;
-    replace_partition.reserve(partition[from].size()+partition[replace].size());
-    replace_partition.insert(replace_partition.end(),partition[from].begin(),partition[from].end());
-    replace_partition.insert(replace_partition.end(),partition[replace].begin(),partition[replace].end());
-    auto new_replace = replace_partition.empty() ? codebook[from] : calculate_centroid(data,replace_partition);
+    const TrainingSet &grouped = partition.grouped;
+    uint from_begin = partition.bucket_start[from],from_size = partition.bucket_size(from);
+    uint replace_begin = partition.bucket_start[replace],replace_size = partition.bucket_size(replace);
+    uint to_begin = partition.bucket_start[to],to_size = partition.bucket_size(to);
+    auto replace_sum = centroid_sum(grouped,from_begin,from_size);
+    replace_sum.add(centroid_sum(grouped,replace_begin,replace_size));
+    auto new_replace = (from_size+replace_size == 0) ? codebook[from] : replace_sum.centroid();
     u64 from_distortion = 0;
-    for (uint idx : replace_partition) {
-        from_distortion += blockDistortion(new_replace,data[idx])*data[idx].weight;
+    for (uint n=from_begin;n<from_begin+from_size;n++) {
+        from_distortion += blockDistortion(new_replace,grouped.block(n))*grouped.weight[n];
+    }
+    for (uint n=replace_begin;n<replace_begin+replace_size;n++) {
+        from_distortion += blockDistortion(new_replace,grouped.block(n))*grouped.weight[n];
     }
     // TODO: Maybe subtract distortion prior to merge?
 
     // Possible early out (TODO profile)
     if (from_distortion > target_distortion) return false;
 
-    auto [new_from,new_to] = bbox_distrib(data,partition[to]);
+    auto [new_from,new_to] = bbox_distrib(grouped,to_begin,to_size);
     // Adjust new vectors
     std::vector<CPYuvBlock> adjust_codes = {new_from,new_to};
     u64 adjust_distortion[2];
-    std::vector<std::vector<uint>> adjust_partition(2);
-    adjust_partition[0].reserve(partition[to].size());
-    adjust_partition[1].reserve(partition[to].size());
+    auto &adjust_label = partition.shift_label;
+    adjust_label.resize(to_size);
     for (uint iter=0;iter<soca_iterations;iter++) {
-        adjust_partition[0].clear();
-        adjust_partition[1].clear();
-        voronoi_partition(adjust_codes,data,partition[to],adjust_distortion,adjust_partition);
-        if (adjust_partition[0].empty()||adjust_partition[1].empty()) return false;
-        adjust_codes[0] = calculate_centroid(data,adjust_partition[0]);
-        adjust_codes[1] = calculate_centroid(data,adjust_partition[1]);
-    }
-    adjust_partition[0].clear();
-    adjust_partition[1].clear();
+        voronoi_partition(adjust_codes,grouped,to_begin,to_size,adjust_distortion,adjust_label.data());
+        CentroidSum adjust_sum[2];
+        for (uint k=0;k<to_size;k++) adjust_sum[adjust_label[k]].add(grouped.block(to_begin+k));
+        if (adjust_sum[0].weight == 0 || adjust_sum[1].weight == 0) return false;
+        adjust_codes[0] = adjust_sum[0].centroid();
+        adjust_codes[1] = adjust_sum[1].centroid();
+    }
     adjust_distortion[0] = 0;
     adjust_distortion[1] = 0;
-    u64 to_distortion = voronoi_partition(adjust_codes,data,partition[to],adjust_distortion,adjust_partition);
+    u64 to_distortion = voronoi_partition(adjust_codes,grouped,to_begin,to_size,adjust_distortion,adjust_label.data());
 
     if (to_distortion + from_distortion > target_distortion) return false;
 
     //fprintf(stderr,"SoCA OK! %llu %llu %llu\n",to_distortion,from_distortion,target_distortion);
     // actually do shift
-    partition[replace].insert(partition[replace].end(),partition[from].begin(),partition[from].end());
-    partition[from] = std::move(adjust_partition[0]);
+    for (uint n=from_begin;n<from_begin+from_size;n++) {
+        partition.label[partition.members[n]] = replace;
+    }
+    for (uint k=0;k<to_size;k++) {
+        partition.label[partition.members[to_begin+k]] = adjust_label[k] ? to : from;
+    }
+    partition.shift(set,from,replace,to);
     code_distortion[from] = adjust_distortion[0];
-    partition[to] = std::move(adjust_partition[1]);
     code_distortion[to] = adjust_distortion[1];
     return true;
 }
 
-u64 CPEncoderState::vq_elbg(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const CPYuvBlock *data, std::vector<uint> &applicable_indices,std::vector<u8> *closest_out) {
+u64 CPEncoderState::vq_elbg(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const TrainingSet &set,std::vector<u8> *closest_out,
+    CPClock::time_point deadline
+) {
 
     assert(target_codebook_size>=1);
     assert(target_codebook_size<=256);
 
-    uint iteration_left = (codebook.size()*2>target_codebook_size) ? lbg_iterations : split_iterations;
+    uint iteration_left = (codebook.size()*2>target_codebook_size) ? effort.lbg_iterations : effort.split_iterations;
 
     if (codebook.empty()) {
         // Generate initial codeword. Doesn't matter what it is.
         codebook.push_back({0});
     }
 
-    std::vector<std::vector<uint>> partition;
+    // Any codebook is usable, so running out of time just ends training where it is
+    auto out_of_time = [&](){
+        if (deadline == CPClock::time_point::max() || CPClock::now() < deadline) return false;
+        deadline_cut = true;
+        return true;
+    };
+
+    auto partition = acquire_partition();
+    partition->label.resize(set.count);
     u64 code_distortion[256];
+    PartitionBounds bounds;
     for (;;) {
-        partition.resize(codebook.size());
-        for (auto p : partition) {
-            p.clear();
-            p.reserve((applicable_indices.size()/codebook.size())*2);
-        }
         std::fill_n(code_distortion,256,0);
         
-        u64 total_distortion = voronoi_partition(codebook,data,applicable_indices,code_distortion,partition);
+        // Codebook stays the same until the centroid update, so index is good for SoCA, too
+        CodebookIndex index;
+        bool use_index = codebook.size() >= index_min_codebook_size;
+        if (use_index) index.build(codebook);
+        u64 total_distortion = use_index
+            ? voronoi_partition_bounded(codebook,index,set,code_distortion,partition->label.data(),bounds,pool.get())
+            : voronoi_partition(codebook,set,0,set.count,code_distortion,partition->label.data(),pool.get());
+        partition->group(set);
 
         // ELBG special sauce!
         if (codebook.size() >= 8 && iteration_left > 0) {
@@ -374,17 +1035,18 @@ u64 CPEncoderState::vq_elbg(std::vector<CPYuvBlock> &codebook,uint target_codebo
                 return code_distortion[i] < code_distortion[j];
             });
             uint upmost = codebook.size()-1;
-            for (uint i=0;i<soca_search_len_lower;i++) {
+            for (uint i=0;i<effort.soca_search_len;i++) {
                 if (code_distortion[distortion_rank[i]] > shift_max_dist) break;
                 // Documented ELBG does stochastic selection of "to"
                 // Randomness is bad, so we just always pick a fight with the top N
                 if (i>=upmost) break;
-                if (try_shift(codebook,data,distortion_rank[i],distortion_rank[upmost],code_distortion,partition)) {
+                if (out_of_time()) break;
+                if (try_shift(codebook,use_index ? &index : nullptr,set,distortion_rank[i],distortion_rank[upmost],code_distortion,*partition,effort.soca_iterations)) {
                     upmost--;
                 }
                 /*
                 for (uint j=codebook.size()-1,left=soca_search_len_upper ; left>0 && j>i && code_distortion[distortion_rank[j]]>=mean_distortion ; j--,left--) {
-                    if (try_shift(codebook,data,distortion_rank[i],distortion_rank[j],code_distortion,partition)) {
+                    if (try_shift(codebook,use_index ? &index : nullptr,set,distortion_rank[i],distortion_rank[j],code_distortion,*partition)) {
                         // Re-sort top couple entries
                         std::sort(distortion_rank+std::max(int(i),int(codebook.size()-soca_sort_len)),distortion_rank+codebook.size(),[&](u8 i, u8 j){
                             return code_distortion[i] < code_distortion[j];
@@ -396,11 +1058,14 @@ u64 CPEncoderState::vq_elbg(std::vector<CPYuvBlock> &codebook,uint target_codebo
         }
 
         
-        for(uint i=0;i<codebook.size();i++) {
-            if (partition[i].empty()) continue;
-            codebook[i] = calculate_centroid(data,partition[i]);
-        }
+        pool->parallel_for(0,codebook.size(),centroid_chunk_size,[&](uint begin,uint end){
+            for(uint i=begin;i<end;i++) {
+                if (!partition->bucket_size(i)) continue;
+                codebook[i] = calculate_centroid(partition->grouped,partition->bucket_start[i],partition->bucket_size(i));
+            }
+        });
 
+        if (out_of_time()) break;
         if (!--iteration_left) {
             bool codebook_grew = false;
             for (uint split_i = 0,split_max = codebook.size();split_i < split_max && codebook.size() < target_codebook_size;split_i++) {
@@ -426,26 +1091,43 @@ u64 CPEncoderState::vq_elbg(std::vector<CPYuvBlock> &codebook,uint target_codebo
             }
             if (!codebook_grew) break; // We're done...
             if (codebook.size() == target_codebook_size) {
-                iteration_left = lbg_iterations;
+                iteration_left = effort.lbg_iterations;
             } else {
-                iteration_left = split_iterations;
+                iteration_left = effort.split_iterations;
             }
         }
     }
 
     // Partition one more time
-    for (auto p : partition) {
-        p.clear();
-    }
     // Note: code_distortion isn't cleared because we DGAS
-    u64 distortion_total = voronoi_partition(codebook,data,applicable_indices,code_distortion,partition);
-    // Fill closest_out from partition data
+    u64 distortion_total;
+    if (codebook.size() >= index_min_codebook_size) {
+        CodebookIndex index;
+        index.build(codebook);
+        distortion_total = voronoi_partition_bounded(codebook,index,set,code_distortion,partition->label.data(),bounds,pool.get());
+    } else {
+        distortion_total = voronoi_partition(codebook,set,0,set.count,code_distortion,partition->label.data(),pool.get());
+    }
+    // Fill closest_out from labels
     if (closest_out) {
-        for (uint i=0;i<partition.size();i++) {
-            for (auto idx : partition[i]) {
-                (*closest_out)[idx] = u8(i);
-            }
+        for (uint n=0;n<set.count;n++) {
+            (*closest_out)[set.indices[n]] = partition->label[n];
         }
+        set.expand_labels(*closest_out);
     }
+    release_partition(std::move(partition));
     return distortion_total;
 }
+
+std::unique_ptr<VoronoiPartition> CPEncoderState::acquire_partition() {
+    std::lock_guard<std::mutex> guard(partition_lock);
+    if (free_partitions.empty()) return std::make_unique<VoronoiPartition>();
+    auto partition = std::move(free_partitions.back());
+    free_partitions.pop_back();
+    return partition;
+}
+
+void CPEncoderState::release_partition(std::unique_ptr<VoronoiPartition> partition) {
+    std::lock_guard<std::mutex> guard(partition_lock);
+    free_partitions.push_back(std::move(partition));
+}
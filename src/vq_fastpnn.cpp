@@ -5,35 +5,31 @@
 constexpr uint LEAF_SIZE = 8;
 
 
+// Three-way partition around a median-of-three pivot.
+// Returns the range of elements equal to the pivot, everything below it is smaller, everything after larger.
 template<typename T,typename F>
-static T *partition(T *begin, T *end, F valuate) {
+static std::pair<T*,T*> partition(T *begin, T *end, F valuate) {
     // Note: end is inclusive
-
-    // Pick pivot using median-of-three strategy
     T *middle = begin + ((end-begin)>>1);
-    assert(end >= begin);
     assert(end > begin);
-    assert(middle >= begin);
-    assert(middle <= end);
-    T *pivot;
     auto begin_val  = valuate(begin );
     auto middle_val = valuate(middle);
     auto end_val    = valuate(end   );
-    if      ((begin_val > middle_val) ^ (begin_val > end_val)) pivot = begin;
-    else if ((begin_val > middle_val) ^ (end_val > begin_val)) pivot = middle;
-    else                                                       pivot = end;
-
-    // Partition 
-    auto pivot_val = valuate(pivot);
-    auto store = begin;
-    auto read = begin;
-    // swap pivot to end of list
-    std::swap(*pivot,*end);
-    for(;read<end;read++) {
-        if (valuate(read) <= pivot_val) std::swap(*read,*store++);
+    decltype(begin_val) pivot_val;
+    if      ((begin_val > middle_val) ^ (begin_val > end_val)) pivot_val = begin_val;
+    else if ((begin_val > middle_val) ^ (end_val > begin_val)) pivot_val = middle_val;
+    else                                                       pivot_val = end_val;
+
+    // Blocks often share component values, so equal keys are grouped
+    // in the middle instead of piling up on one side
+    T *lower = begin, *read = begin, *upper = end;
+    while (read <= upper) {
+        auto val = valuate(read);
+        if      (val < pivot_val) std::swap(*read++,*lower++);
+        else if (val > pivot_val) std::swap(*read,*upper--);
+        else    read++;
     }
-    std::swap(*end,*store);
-    return store;
+    return {lower,upper};
 }
 
 // Fast median partitioning
@@ -46,33 +42,22 @@ static T *quickselect(T *begin, T *end, uint k, F valuate) {
         // Exit if called with size=1
         if (begin == end) return begin;
         assert(end > begin);
-        auto pivot = partition(begin,end,valuate);
-        assert(pivot >= begin);
-        assert(pivot <= end);
-        // Choose top or bottom half
-        uint pivot_index = pivot-begin;
-        if (pivot_index == k) {
-            return pivot;
-        } else if (k < pivot_index) {
-            end = pivot - 1;
-            assert(end >= begin);
+        auto [equal_begin,equal_end] = partition(begin,end,valuate);
+        // Choose top or bottom part, unless k is among the pivot's equals
+        uint low_index = equal_begin-begin;
+        uint high_index = equal_end-begin;
+        if (k < low_index) {
+            end = equal_begin - 1;
+        } else if (k > high_index) {
+            k -= high_index+1;
+            begin = equal_end + 1;
         } else {
-            k -= pivot_index+1;
-            begin = pivot + 1;
-            assert(end >= begin);
+            return begin+k;
         }
+        assert(end >= begin);
     }
 }
 
-template<typename T,typename F>
-static void quicksort(T *begin, T *end, F valuate) {
-    // Exit if called with size=1 or size=0
-    if (begin == end-1 || begin == end) return;
-    auto pivot = partition(begin,end-1,valuate);
-    quicksort(begin,pivot,valuate);
-    quicksort(pivot+1,end,valuate);
-}
-
 
 static std::pair<uint,u8> max_extent(CPYuvBlock *begin,CPYuvBlock *end) {
     u8 ytlmin=255,ytrmin=255,yblmin=255,ybrmin=255,umin=255,vmin=255;
@@ -104,130 +89,127 @@ static std::pair<uint,u8> max_extent(CPYuvBlock *begin,CPYuvBlock *end) {
     return {std::distance(values.begin(),max_element) + offsetof(CPYuvBlock,u),*max_element};
 }
 
-struct KDnode {
-    int8_t axis_or_fill; // if positive, offset of split element, if negative, amount of leaf data
-    u8 threshold;
-    union {
-        struct {
-            KDnode *lower,*upper;
-        };
-        CPYuvBlock *leaf_data;
-    };
-    inline bool is_leaf() {return axis_or_fill < 0;};
-    // Default non-constructor
-    KDnode() : axis_or_fill{0},lower{nullptr},upper{nullptr} {};
-    // leaf constructor
-    KDnode(CPYuvBlock *leaf_data,uint fill) : axis_or_fill{int8_t(-int(fill))},leaf_data{leaf_data} {};
-    // branch constructor
-    KDnode(KDnode *lower, KDnode *upper,u8 threshold,uint axis) : axis_or_fill{int8_t(axis)},threshold{threshold},lower{lower},upper{upper} {};
-    // move constructor
-    KDnode(KDnode &&src) : axis_or_fill{src.axis_or_fill},threshold{src.threshold} {
-        if (is_leaf()) {
-            leaf_data = src.leaf_data;
-        } else {
-            upper = src.upper;
-            lower = src.lower;
-            src.upper = nullptr;
-            src.lower = nullptr;
-        }
+uint PNNWorkspace::alloc_node() {
+    if (free_nodes.empty()) {
+        nodes.emplace_back();
+        return nodes.size()-1;
     }
-    // I hate C++
-    KDnode &operator=(KDnode &&other) {
-        if (this != &other) {
-            // Is construct-in-place correct here?
-            new(this) KDnode(std::move(other));
-        }
-        return *this;
-    }
-    // Destructor
-    ~KDnode() {
-        if (!is_leaf()) {
-            delete lower;
-            delete upper;
-        }
+    uint node = free_nodes.back();
+    free_nodes.pop_back();
+    return node;
+}
+
+void PNNWorkspace::free_subtree(uint node) {
+    if (!nodes[node].is_leaf()) {
+        free_subtree(nodes[node].lower);
+        free_subtree(nodes[node].upper);
     }
+    free_nodes.push_back(node);
+}
 
-};
+// Leaf counts of a tree over count and count+1 vectors.
+// The split is always at the median, so the shape only depends on the count.
+static std::pair<uint,uint> kdtree_leaves(uint count) {
+    if (count <= LEAF_SIZE) return {1,count+1 <= LEAF_SIZE ? 1 : 2};
+    auto [half,half_plus] = kdtree_leaves(count/2);
+    if (count&1) return {half+half_plus,2*half_plus};
+    else return {2*half,half+half_plus};
+}
+
+static uint kdtree_nodes(uint count) {
+    return 2*kdtree_leaves(count).first-1;
+}
+
+// Subtrees at least this big get built as their own task
+constexpr uint PARALLEL_BUILD_MIN = 4096;
 
+// Descendants of node are taken from spare in preorder,
+// so both halves know their nodes before either is built.
 // Tuple returned is leaf and vector counts
-static std::pair<uint,uint> build_kdtree(CPYuvBlock *begin, CPYuvBlock *end, KDnode *emplace) {
+static std::pair<uint,uint> build_subtree(PNNWorkspace &ws, uint begin, uint end, uint node, const uint *spare, CPThreadPool *pool) {
 
     uint count = end-begin;
     assert(count > 0);
     if (count <= LEAF_SIZE) {
-        new(emplace) KDnode(begin,count);
+        ws.nodes[node] = KDnode(begin,count);
         return {1,count};
     } else {
-        uint median_idx = std::distance(begin,end) / 2;
-        auto [axis,extent] = max_extent(begin,end);
-        if (extent == 0 && false) {
-            // Can squash entire thing
-            // But TODO this actually results in worse everything, so don't
-            u16 total_weight = 0;
-            for (auto blk=begin;blk!=end;blk++) {
-                total_weight = clamp_u16(total_weight+blk->weight);
-            }
-            begin->weight = total_weight;
-            new(emplace) KDnode(begin,1);
-            return {1,1};
+        auto vectors = ws.vectors.data();
+        uint median_idx = count / 2;
+        auto [axis,extent] = max_extent(vectors+begin,vectors+end);
+        uint pivot = quickselect(vectors+begin,vectors+end,median_idx,[axis](CPYuvBlock *block){return block_byte(*block,axis);}) - vectors;
+        uint lower_nodes = kdtree_nodes(median_idx);
+        uint lower_node = spare[0], upper_node = spare[lower_nodes];
+        std::pair<uint,uint> lower,upper;
+        if (count >= PARALLEL_BUILD_MIN && pool->worker_count() > 0) {
+            CPThreadPool::TaskGroup group;
+            pool->run(group,[&](){lower = build_subtree(ws,begin,pivot,lower_node,spare+1,pool);});
+            upper = build_subtree(ws,pivot,end,upper_node,spare+lower_nodes+1,pool);
+            pool->wait(group);
         } else {
-            auto pivot = quickselect(begin,end,median_idx,[axis](CPYuvBlock *block){return block_byte(*block,axis);});
-            auto lower_node = (KDnode*)::operator new(sizeof(KDnode));
-            auto lower = build_kdtree(begin,pivot,lower_node);
-            auto upper_node = (KDnode*)::operator new(sizeof(KDnode));
-            auto upper = build_kdtree(pivot,end,upper_node);
-            new(emplace) KDnode(lower_node,upper_node,block_byte(*pivot,axis),axis);
-            return {lower.first+upper.first,lower.second+upper.second};
+            lower = build_subtree(ws,begin,pivot,lower_node,spare+1,pool);
+            upper = build_subtree(ws,pivot,end,upper_node,spare+lower_nodes+1,pool);
         }
-    }    
+        ws.nodes[node] = KDnode(lower_node,upper_node,block_byte(vectors[pivot],axis),axis);
+        return {lower.first+upper.first,lower.second+upper.second};
+    }
 }
 
+// Tuple returned is leaf and vector counts
+static std::pair<uint,uint> build_kdtree(PNNWorkspace &ws, uint begin, uint end, uint node, CPThreadPool *pool) {
+    // Allocate everything first, so the node array can't move under the tasks
+    ws.spare.resize(kdtree_nodes(end-begin)-1);
+    for (auto &spare : ws.spare) spare = ws.alloc_node();
+    return build_subtree(ws,begin,end,node,ws.spare.data(),pool);
+}
 
-static CPYuvBlock *tree_flatten(CPYuvBlock* dst,KDnode *node) {
-    if (node->is_leaf()) {
-        auto leaf_data = node->leaf_data;
+static CPYuvBlock *tree_flatten(const PNNWorkspace &ws,CPYuvBlock* dst,uint node) {
+    auto &kd = ws.nodes[node];
+    if (kd.is_leaf()) {
+        auto leaf_data = ws.vectors.data() + kd.leaf_data;
         if (leaf_data != dst) std::copy(
             leaf_data,
-            leaf_data - node->axis_or_fill,
+            leaf_data - kd.axis_or_fill,
             dst
         );
-        dst -= node->axis_or_fill;
+        dst -= kd.axis_or_fill;
     } else {
-        dst = tree_flatten(dst,node->lower);
-        dst = tree_flatten(dst,node->upper);
+        dst = tree_flatten(ws,dst,kd.lower);
+        dst = tree_flatten(ws,dst,kd.upper);
     }
     return dst;
 }
 
 constexpr uint REBLANCE_RATIO = 2;
 
-static uint rebalance_kdtree(KDnode *node) {
+static uint rebalance_kdtree(PNNWorkspace &ws,uint node,CPThreadPool *pool) {
     // very approximate "rebalancing".
     // really just progressively deconstructing the tree
-    if (node->is_leaf()) return 0-node->axis_or_fill;
-    uint lower_size = rebalance_kdtree(node->lower);
-    uint upper_size = rebalance_kdtree(node->upper);
-    if (node->lower->is_leaf() && node->upper->is_leaf() && lower_size+upper_size <= LEAF_SIZE) {
+    auto &nodes = ws.nodes;
+    if (nodes[node].is_leaf()) return 0-nodes[node].axis_or_fill;
+    uint lower = nodes[node].lower, upper = nodes[node].upper;
+    uint lower_size = rebalance_kdtree(ws,lower,pool);
+    uint upper_size = rebalance_kdtree(ws,upper,pool);
+    if (nodes[lower].is_leaf() && nodes[upper].is_leaf() && lower_size+upper_size <= LEAF_SIZE) {
+        auto vectors = ws.vectors.data();
         std::copy(
-            node->upper->leaf_data,
-            node->upper->leaf_data + upper_size,
-            node->lower->leaf_data + lower_size
+            vectors + nodes[upper].leaf_data,
+            vectors + nodes[upper].leaf_data + upper_size,
+            vectors + nodes[lower].leaf_data + lower_size
         );
-        auto leaf_data = node->lower->leaf_data;
-        node->axis_or_fill = int8_t(0-(lower_size+upper_size));
-        delete node->lower;
-        delete node->upper;
-        node->leaf_data = leaf_data;
+        nodes[node] = KDnode(nodes[lower].leaf_data,lower_size+upper_size);
+        ws.free_nodes.push_back(lower);
+        ws.free_nodes.push_back(upper);
         return lower_size+upper_size;
     } else if (lower_size > REBLANCE_RATIO*upper_size || upper_size > REBLANCE_RATIO*lower_size) {
-        auto lowest_lower = node->lower;
-        while (!lowest_lower->is_leaf()) lowest_lower = lowest_lower->lower;
-        auto data = lowest_lower->leaf_data;
-        auto end = tree_flatten(data,node);
-        node->~KDnode(); // Manually destroy so we can emplace new node over same memory
-        auto [leaves,vectors] = build_kdtree(data,end,node);
-        //fprintf(stderr,"Node Rebuilt!\n");
-        //fprintf(stderr,"Should rebuild node, but shit's busted %u %u\n",lower_size,upper_size);
+        auto lowest_lower = lower;
+        while (!nodes[lowest_lower].is_leaf()) lowest_lower = nodes[lowest_lower].lower;
+        uint data = nodes[lowest_lower].leaf_data;
+        uint end = tree_flatten(ws,ws.vectors.data()+data,node) - ws.vectors.data();
+        // Rebuild over the same root, reusing the old nodes
+        ws.free_subtree(lower);
+        ws.free_subtree(upper);
+        auto [leaves,vectors] = build_kdtree(ws,data,end,node,pool);
         return vectors;
     } else {
         return lower_size+upper_size;
@@ -235,146 +217,324 @@ static uint rebalance_kdtree(KDnode *node) {
 }
 
 [[maybe_unused]]
-static uint count_leaves(KDnode *node) {
-    if (node->is_leaf()) return 1;
-    else return count_leaves(node->lower) + count_leaves(node->upper);
+static uint count_leaves(const PNNWorkspace &ws,uint node) {
+    if (ws.nodes[node].is_leaf()) return 1;
+    else return count_leaves(ws,ws.nodes[node].lower) + count_leaves(ws,ws.nodes[node].upper);
 }
 
-struct MergeInfo {
-    KDnode *node;
-    u32 distortion;
-    std::pair<u8,u8> pair;
-    u8 inter_weight;
-};
-
-static MergeInfo *gen_leaf_merge(KDnode *node,MergeInfo *merge_dst) {
+// Gray vectors only differ in luma, so MONO skips the chroma lanes
+template<bool MONO>
+static void gen_leaf_merge(KDnode &node,const CPYuvBlock *vectors) {
 
     // Find lowest merge distortion inside leaf bucket
     u64 lowest_distortion = UINT64_MAX;
     std::pair<u8,u8> best_pair(0,0);
-    u8 fill = u8(0-node->axis_or_fill);
-    if (fill<2) return merge_dst;
+    u8 fill = u8(0-node.axis_or_fill);
+    auto leaf_data = vectors + node.leaf_data;
+    assert(fill >= 2);
     for (u8 i=0;i<fill-1;i++) {
-        auto i_block = node->leaf_data[i];
+        auto i_block = leaf_data[i];
         for (u8 j=i+1;j<fill;j++) {
-            auto j_block = node->leaf_data[j];
-            u64 distortion = blockDistortion(i_block,j_block);
-            distortion *= (i_block.weight*j_block.weight) / (i_block.weight + j_block.weight);
+            auto j_block = leaf_data[j];
+            u64 distortion = MONO ? lumaDistortion(i_block,j_block) : blockDistortion(i_block,j_block);
+            // Multiply before dividing, or pairs of single vectors would all cost nothing
+            distortion = distortion*i_block.weight*j_block.weight / (i_block.weight + j_block.weight);
             if (distortion < lowest_distortion) {
                 lowest_distortion = distortion;
                 best_pair = {i,j};
             }
         }
     }
-    auto weight1 = node->leaf_data[best_pair.first].weight;
-    auto weight2 = node->leaf_data[best_pair.second].weight;
+    auto weight1 = leaf_data[best_pair.first].weight;
+    auto weight2 = leaf_data[best_pair.second].weight;
     u8 inter_weight = clamp_u8((511*weight1+weight2)/(2*(weight1+weight2)));
 
-    *merge_dst++ = {
-        .node = node,
+    node.merge = {
         .distortion = (u32)std::min(lowest_distortion,(u64)UINT32_MAX),
-        .pair = best_pair,
+        .first = best_pair.first,
+        .second = best_pair.second,
         .inter_weight = inter_weight,
+        .dirty = false,
     };
-    return merge_dst;
 }
 
-static MergeInfo *gen_merges(KDnode *node,MergeInfo *merge_dst) {
-    if (node->is_leaf()) {
-        merge_dst = gen_leaf_merge(node,merge_dst);
+#ifdef CINEPUNK_AVX2
+
+// Same search as gen_leaf_merge, for all pairs with one vector in a row.
+// Each pair gets the key cost<<6 | i<<3 | j, so the lowest key is
+// also the pair the scalar loop would have found first.
+template<bool MONO>
+static void __attribute__((target("avx2"))) gen_leaf_merge_AVX2(KDnode &node,const CPYuvBlock *vectors) {
+    static_assert(LEAF_SIZE <= 8);
+    assert(Y_WEIGHT == 1 && U_WEIGHT == 2 && V_WEIGHT == 2);
+    static_assert(sizeof(CPYuvBlock) == 8);
+    u8 fill = u8(0-node.axis_or_fill);
+    auto leaf_data = vectors + node.leaf_data;
+    assert(fill >= 2);
+    // Load the whole leaf, lanes past the fill are masked out below.
+    // Vector j ends up in lane j, with the first and second half of the block split.
+    __m256i blocks_lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(leaf_data+0));
+    __m256i blocks_hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(leaf_data+4));
+    __m256i even_dwords = _mm256_setr_epi32(0,2,4,6,0,2,4,6);
+    __m256i odd_dwords  = _mm256_setr_epi32(1,3,5,7,1,3,5,7);
+    __m256i weight_uv = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(blocks_lo,even_dwords),_mm256_permutevar8x32_epi32(blocks_hi,even_dwords),0xF0);
+    __m256i luma      = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(blocks_lo,odd_dwords), _mm256_permutevar8x32_epi32(blocks_hi,odd_dwords), 0xF0);
+    // Component pairs in the 16 bit halves of each dword, like voronoi_partition_AVX2
+    __m256i low_pair  = _mm256_setr_epi8(0,-1,1,-1,4,-1,5,-1,8,-1,9,-1,12,-1,13,-1,0,-1,1,-1,4,-1,5,-1,8,-1,9,-1,12,-1,13,-1);
+    __m256i high_pair = _mm256_setr_epi8(2,-1,3,-1,6,-1,7,-1,10,-1,11,-1,14,-1,15,-1,2,-1,3,-1,6,-1,7,-1,10,-1,11,-1,14,-1,15,-1);
+    __m256i vec_ytop    = _mm256_shuffle_epi8(luma,low_pair);
+    __m256i vec_ybottom = _mm256_shuffle_epi8(luma,high_pair);
+    __m256i vec_uv      = _mm256_shuffle_epi8(weight_uv,high_pair);
+    __m256i weight = _mm256_and_si256(weight_uv,_mm256_set1_epi32(0xFFFF));
+    __m256d weight_lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(weight));
+    __m256d weight_hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(weight,1));
+    __m256i lane_lo = _mm256_setr_epi64x(0,1,2,3);
+    __m256i lane_hi = _mm256_setr_epi64x(4,5,6,7);
+    __m256i in_leaf_lo = _mm256_cmpgt_epi64(_mm256_set1_epi64x(fill),lane_lo);
+    __m256i in_leaf_hi = _mm256_cmpgt_epi64(_mm256_set1_epi64x(fill),lane_hi);
+    // Adding 2^52 puts a whole double below 2^52 into the low mantissa bits
+    __m256d magic = _mm256_set1_pd(4503599627370496.0);
+    __m256i no_pair = _mm256_set1_epi64x(INT64_MAX);
+    __m256i best_lo = no_pair, best_hi = no_pair;
+
+    for (uint i=0;i<fill-1u;i++) {
+        __m256i lane_i = _mm256_set1_epi32(i);
+        __m256i dytop    = _mm256_sub_epi16(vec_ytop,   _mm256_permutevar8x32_epi32(vec_ytop,lane_i));
+        __m256i dybottom = _mm256_sub_epi16(vec_ybottom,_mm256_permutevar8x32_epi32(vec_ybottom,lane_i));
+        __m256i distortion = _mm256_add_epi32(_mm256_madd_epi16(dytop,dytop),_mm256_madd_epi16(dybottom,dybottom));
+        if (!MONO) {
+            __m256i duv = _mm256_sub_epi16(vec_uv,_mm256_permutevar8x32_epi32(vec_uv,lane_i));
+            distortion = _mm256_add_epi32(distortion,_mm256_madd_epi16(duv,_mm256_add_epi16(duv,duv)));
+        }
+        // Weighted cost in double, exact since it stays below 2^53
+        __m256d weight_i = _mm256_set1_pd(leaf_data[i].weight);
+        __m256d cost_lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(distortion));
+        __m256d cost_hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(distortion,1));
+        cost_lo = _mm256_floor_pd(_mm256_div_pd(_mm256_mul_pd(cost_lo,_mm256_mul_pd(weight_i,weight_lo)),_mm256_add_pd(weight_i,weight_lo)));
+        cost_hi = _mm256_floor_pd(_mm256_div_pd(_mm256_mul_pd(cost_hi,_mm256_mul_pd(weight_i,weight_hi)),_mm256_add_pd(weight_i,weight_hi)));
+        __m256i key_lo = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(cost_lo,magic)),_mm256_castpd_si256(magic));
+        __m256i key_hi = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(cost_hi,magic)),_mm256_castpd_si256(magic));
+        __m256i row = _mm256_set1_epi64x(i<<3);
+        key_lo = _mm256_or_si256(_mm256_slli_epi64(key_lo,6),_mm256_or_si256(row,lane_lo));
+        key_hi = _mm256_or_si256(_mm256_slli_epi64(key_hi,6),_mm256_or_si256(row,lane_hi));
+        // Only pairs with i < j inside the leaf
+        __m256i after_i = _mm256_set1_epi64x(i);
+        __m256i valid_lo = _mm256_and_si256(in_leaf_lo,_mm256_cmpgt_epi64(lane_lo,after_i));
+        __m256i valid_hi = _mm256_and_si256(in_leaf_hi,_mm256_cmpgt_epi64(lane_hi,after_i));
+        key_lo = _mm256_blendv_epi8(no_pair,key_lo,valid_lo);
+        key_hi = _mm256_blendv_epi8(no_pair,key_hi,valid_hi);
+        best_lo = _mm256_blendv_epi8(best_lo,key_lo,_mm256_cmpgt_epi64(best_lo,key_lo));
+        best_hi = _mm256_blendv_epi8(best_hi,key_hi,_mm256_cmpgt_epi64(best_hi,key_hi));
+    }
+    best_lo = _mm256_blendv_epi8(best_lo,best_hi,_mm256_cmpgt_epi64(best_lo,best_hi));
+    alignas(32) u64 best_out[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(best_out),best_lo);
+    u64 best = *std::min_element(best_out,best_out+4);
+
+    u8 first = (best>>3)&7, second = best&7;
+    auto weight1 = leaf_data[first].weight;
+    auto weight2 = leaf_data[second].weight;
+    node.merge = {
+        .distortion = (u32)std::min(best>>6,(u64)UINT32_MAX),
+        .first = first,
+        .second = second,
+        .inter_weight = clamp_u8((511*weight1+weight2)/(2*(weight1+weight2))),
+        .dirty = false,
+    };
+}
+
+#endif
+
+static inline bool can_merge(const KDnode &leaf) {return leaf.axis_or_fill <= -2;}
+
+static void collect_leaves(const PNNWorkspace &ws,uint node,std::vector<uint> &leaves,std::vector<uint> &dirty) {
+    auto &kd = ws.nodes[node];
+    if (kd.is_leaf()) {
+        if (!can_merge(kd)) return;
+        leaves.push_back(node);
+        if (kd.merge.dirty) dirty.push_back(node);
     } else {
-        merge_dst = gen_merges(node->lower,merge_dst);
-        merge_dst = gen_merges(node->upper,merge_dst);
+        collect_leaves(ws,kd.lower,leaves,dirty);
+        collect_leaves(ws,kd.upper,leaves,dirty);
     }
+}
+
+constexpr uint MERGE_CHUNK_SIZE = 256;
+
+// Fills the heap with every leaf that has something to merge.
+// Only leaves that changed since their last search are searched again.
+template<typename F>
+static uint gen_merges(PNNWorkspace &ws,uint root,F merge_after,void (*search)(KDnode&,const CPYuvBlock*),CPThreadPool *pool) {
+    ws.heap.clear();
+    ws.dirty.clear();
+    collect_leaves(ws,root,ws.heap,ws.dirty);
+    pool->parallel_for(0,ws.dirty.size(),MERGE_CHUNK_SIZE,[&](uint begin,uint end){
+        for (uint i=begin;i<end;i++) {
+            search(ws.nodes[ws.dirty[i]],ws.vectors.data());
+        }
+    });
+    std::make_heap(ws.heap.begin(),ws.heap.end(),merge_after);
+    return ws.heap.size();
+}
 
-    return merge_dst;
+// Closes the gap left by the second vector of a merge
+static inline void drop_merged(KDnode &node,CPYuvBlock *leaf_data,u8 second) {
+    if (0-second != 1+node.axis_or_fill) std::copy(
+        leaf_data + second + 1, // Source begin
+        leaf_data - node.axis_or_fill, // Source end (remember, fill is negative)
+        leaf_data + second // Destination begin
+    );
+    node.axis_or_fill++;
+    node.merge.dirty = true;
 }
 
-static void do_merge(MergeInfo merge) {
-    assert(merge.pair.first < merge.pair.second);
+template<bool MONO>
+static void do_merge(KDnode &node,CPYuvBlock *vectors) {
+    auto merge = node.merge;
+    assert(!merge.dirty);
+    assert(merge.first < merge.second);
     u8 aw = merge.inter_weight;
     u8 bw = aw^255;
-    CPYuvBlock a = merge.node->leaf_data[merge.pair.first];
-    CPYuvBlock b = merge.node->leaf_data[merge.pair.second];
-    merge.node->leaf_data[merge.pair.first] = {
+    auto leaf_data = vectors + node.leaf_data;
+    CPYuvBlock a = leaf_data[merge.first];
+    CPYuvBlock b = leaf_data[merge.second];
+    leaf_data[merge.first] = {
         .weight = clamp_u16(a.weight+b.weight),
-        .u   = u8((a.u  *aw + b.u  *bw + 255)/256),
-        .v   = u8((a.v  *aw + b.v  *bw + 255)/256),
+        .u   = MONO ? u8(128) : u8((a.u  *aw + b.u  *bw + 255)/256),
+        .v   = MONO ? u8(128) : u8((a.v  *aw + b.v  *bw + 255)/256),
         .ytl = u8((a.ytl*aw + b.ytl*bw + 255)/256),
         .ytr = u8((a.ytr*aw + b.ytr*bw + 255)/256),
         .ybl = u8((a.ybl*aw + b.ybl*bw + 255)/256),
         .ybr = u8((a.ybr*aw + b.ybr*bw + 255)/256),
     };
+    drop_merged(node,leaf_data,merge.second);
+}
 
-    if (0-merge.pair.second != 1+merge.node->axis_or_fill) std::copy(
-        merge.node->leaf_data + merge.pair.second + 1, // Source begin
-        merge.node->leaf_data - merge.node->axis_or_fill, // Source end (remember, fill is negative)
-        merge.node->leaf_data + merge.pair.second // Destination begin
-    );
-    merge.node->axis_or_fill++;
+#ifdef CINEPUNK_AVX2
+
+// Blends all components at once. The weight lanes get blended too, then overwritten.
+template<bool MONO>
+static void __attribute__((target("avx2"))) do_merge_AVX2(KDnode &node,CPYuvBlock *vectors) {
+    static_assert(sizeof(CPYuvBlock) == 8);
+    auto merge = node.merge;
+    assert(!merge.dirty);
+    assert(merge.first < merge.second);
+    u8 aw = merge.inter_weight;
+    u8 bw = aw^255;
+    auto leaf_data = vectors + node.leaf_data;
+    CPYuvBlock a = leaf_data[merge.first];
+    CPYuvBlock b = leaf_data[merge.second];
+    __m128i a_words = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&a)));
+    __m128i b_words = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&b)));
+    // Fits in 16 bits, as aw+bw is 255
+    __m128i blend = _mm_add_epi16(_mm_mullo_epi16(a_words,_mm_set1_epi16(aw)),_mm_mullo_epi16(b_words,_mm_set1_epi16(bw)));
+    blend = _mm_srli_epi16(_mm_add_epi16(blend,_mm_set1_epi16(255)),8);
+    CPYuvBlock merged;
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(&merged),_mm_packus_epi16(blend,blend));
+    merged.weight = clamp_u16(a.weight+b.weight);
+    if (MONO) merged.u = merged.v = 128;
+    leaf_data[merge.first] = merged;
+    drop_merged(node,leaf_data,merge.second);
+}
+
+#endif
+
+// Leaf kernels for one PNN run, picked by CPU and by whether the set is gray
+struct LeafKernels {
+    void (*search)(KDnode &node,const CPYuvBlock *vectors);
+    void (*merge)(KDnode &node,CPYuvBlock *vectors);
+};
+
+static LeafKernels leaf_kernels(bool mono) {
+    #ifdef CINEPUNK_AVX2
+    if(__builtin_cpu_supports("avx2")) {
+        if (mono) return {gen_leaf_merge_AVX2<true>,do_merge_AVX2<true>};
+        return {gen_leaf_merge_AVX2<false>,do_merge_AVX2<false>};
+    }
+    #endif
+    if (mono) return {gen_leaf_merge<true>,do_merge<true>};
+    return {gen_leaf_merge<false>,do_merge<false>};
 }
 
-u64 CPEncoderState::vq_fastpnn(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const CPYuvBlock *data, std::vector<uint> &applicable_indices,std::vector<u8> *closest_out) {
+u64 CPEncoderState::vq_fastpnn(std::vector<CPYuvBlock> &codebook,uint target_codebook_size,const TrainingSet &set,std::vector<u8> *closest_out) {
 
     // PNN is not iterative
     codebook.clear();
     // Init data structures
-    auto vectors = std::make_unique<CPYuvBlock[]>(applicable_indices.size());
-    auto end = vectors.get();
+    auto ws = acquire_pnn_workspace();
+    ws->clear();
     // copy blocks into buffer that we can then partition, etc
-    for (uint idx : applicable_indices) {
-        *end++ = data[idx];
+    // The SIMD leaf search loads whole leaves, even at the end
+    ws->vectors.resize(set.count+LEAF_SIZE);
+    for (uint n=0;n<set.count;n++) {
+        ws->vectors[n] = set.block(n);
     }
 
-    KDnode kd_root;
-    auto kd_build_result = build_kdtree(vectors.get(),end,&kd_root);
-    auto kd_leaves = kd_build_result.first;
+    uint kd_root = ws->alloc_node();
+    auto kd_build_result = build_kdtree(*ws,0,set.count,kd_root,pool.get());
     u32 vector_count = kd_build_result.second;
-    vector_count = rebalance_kdtree(&kd_root);
-    const uint mergelist_size = kd_leaves+kd_leaves/2; // Sometimes rebalancing grows the tree
-    auto merges = std::make_unique<MergeInfo[]>(mergelist_size);
-    //fprintf(stderr,"Tree built! %u leaves %u vectors\n",kd_leaves,vector_count);
+    vector_count = rebalance_kdtree(*ws,kd_root,pool.get());
+    //fprintf(stderr,"Tree built! %u leaves %u vectors\n",kd_build_result.first,vector_count);
 
     u64 approx_distortion = 0;
+    auto kernels = leaf_kernels(set.mono);
+    auto &nodes = ws->nodes;
+    auto &heap = ws->heap;
+    // Min-heap on merge distortion
+    auto merge_after = [&nodes](uint a,uint b){return nodes[a].merge.distortion > nodes[b].merge.distortion;};
 
     while (vector_count > target_codebook_size) {
-        //fprintf(stderr,"Leaf count: %u\n",count_leaves(&kd_root));
-        auto merge_end = gen_merges(&kd_root,merges.get());
-        uint merge_count = merge_end - merges.get();
-        assert(merge_count <= mergelist_size);
+        //fprintf(stderr,"Leaf count: %u\n",count_leaves(*ws,kd_root));
+        uint merge_count = gen_merges(*ws,kd_root,merge_after,kernels.search,pool.get());
         assert(merge_count > 0);
-        if (vector_count-merge_count/2 < target_codebook_size) {
-            // Final iteration, need to fully sort candidates
-            quicksort(merges.get(),merge_end,[](MergeInfo *i){return i->distortion;});
-        } else {
-            // Not final iteration, partition is enough
-            auto median = quickselect(merges.get(),merge_end,merge_count/2,[](MergeInfo *i){return i->distortion;});
-            assert(median->distortion >= merges[0].distortion);
-            merge_end = 1+median;
-        }
-        for (auto merge_ptr = merges.get();merge_ptr!=merge_end;merge_ptr++) {
-            do_merge(*merge_ptr);
-            approx_distortion += merge_ptr->distortion;
+        // Take the cheapest merges until the tree needs rebalancing.
+        // A merged leaf is searched again right away and goes back into the heap.
+        for (uint i=0;i<=merge_count/2 && !heap.empty();i++) {
+            std::pop_heap(heap.begin(),heap.end(),merge_after);
+            auto &leaf = nodes[heap.back()];
+            approx_distortion += leaf.merge.distortion;
+            kernels.merge(leaf,ws->vectors.data());
             if (--vector_count == target_codebook_size) goto done;
+            if (can_merge(leaf)) {
+                kernels.search(leaf,ws->vectors.data());
+                std::push_heap(heap.begin(),heap.end(),merge_after);
+            } else {
+                heap.pop_back();
+            }
         }
         //fprintf(stderr,"Merge iterated! %u vectors\n",vector_count);
-        vector_count = rebalance_kdtree(&kd_root);
+        vector_count = rebalance_kdtree(*ws,kd_root,pool.get());
         //fprintf(stderr,"Rebalance iterated!\n");
     }
     done:
     codebook.resize(vector_count);
-    tree_flatten(codebook.data(),&kd_root);
+    tree_flatten(*ws,codebook.data(),kd_root);
+    release_pnn_workspace(std::move(ws));
 
     if (closest_out) {
-        std::vector<std::vector<uint>> partition(codebook.size());
+        auto partition = acquire_partition();
+        partition->label.resize(set.count);
         u64 code_distortion[256];
-        approx_distortion = voronoi_partition(codebook,data,applicable_indices,code_distortion,partition);
-        // Fill closest_out from partition data
-        for (uint i=0;i<partition.size();i++) {
-            for (auto idx : partition[i]) {
-                (*closest_out)[idx] = u8(i);
-            }
+        approx_distortion = voronoi_partition(codebook,set,0,set.count,code_distortion,partition->label.data(),pool.get());
+        // Fill closest_out from labels
+        for (uint n=0;n<set.count;n++) {
+            (*closest_out)[set.indices[n]] = partition->label[n];
         }
+        set.expand_labels(*closest_out);
+        release_partition(std::move(partition));
     }
     return approx_distortion;
-}
\ No newline at end of file
+}
+
+std::unique_ptr<PNNWorkspace> CPEncoderState::acquire_pnn_workspace() {
+    std::lock_guard<std::mutex> guard(pnn_workspace_lock);
+    if (free_pnn_workspaces.empty()) return std::make_unique<PNNWorkspace>();
+    auto ws = std::move(free_pnn_workspaces.back());
+    free_pnn_workspaces.pop_back();
+    return ws;
+}
+
+void CPEncoderState::release_pnn_workspace(std::unique_ptr<PNNWorkspace> ws) {
+    std::lock_guard<std::mutex> guard(pnn_workspace_lock);
+    free_pnn_workspaces.push_back(std::move(ws));
+}